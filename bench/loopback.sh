@@ -0,0 +1,48 @@
+#!/bin/bash
+#
+# Loopback throughput and accuracy benchmark
+# Author: Mikkel Andersen
+# License: MIT
+#
+# Starts udp_responder on 127.0.0.1, scans a port range against it and
+# reports probes per second, accuracy against the responder's ground truth
+# and CPU time per probe. Every STEP-th port is open (bound, answering every
+# payload); all other ports are closed and answered by kernel ICMP.
+#
+# Usage: sudo bench/loopback.sh [start_port] [end_port] [step] [drop]
+#   drop: fraction of requests the responder ignores (default 0)
+#
+# Runs are reproducible: the responder's drop decisions use a fixed seed.
+
+set -e
+
+START=${1:-1}
+END=${2:-1000}
+STEP=${3:-10}
+DROP=${4:-0}
+SEED=1
+
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'kill $RESPONDER_PID 2>/dev/null || true; rm -rf "$WORK"' EXIT
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "Error: needs root for the scanner's ICMP socket" >&2
+    exit 1
+fi
+
+OPEN_PORTS=$(seq -s, "$START" "$STEP" "$END")
+
+"$DIR/udp_responder" -e -p "$OPEN_PORTS" -d "$DROP" -s "$SEED" > "$WORK/responder.log" &
+RESPONDER_PID=$!
+sleep 0.5
+
+TIMEFORMAT='%U %S'
+{ time "$DIR/udp_scanner" -j "$WORK/scan.jsonl" 127.0.0.1 "$START" "$END" \
+    > "$WORK/scan.log" 2> "$WORK/scan.err" ; } 2> "$WORK/cpu"
+
+kill -INT $RESPONDER_PID
+wait $RESPONDER_PID 2>/dev/null || true
+
+awk -v start="$START" -v step="$STEP" -v cpu="$(cat "$WORK/cpu")" \
+    -f "$DIR/bench/report.awk" "$WORK/scan.jsonl" "$WORK/scan.log"
@@ -0,0 +1,433 @@
+/*
+ * Micro-benchmarks for the scanner's per-port hot paths
+ * Author: Mikkel Andersen
+ * License: MIT
+ *
+ * Built by `make bench`, which compiles udp_scanner.c into this program
+ * (without its main) and runs every benchmark. Each one times a loop over a
+ * corpus generated from a fixed seed, so runs on one machine compare
+ * directly and a rewritten function can be measured on its own:
+ *
+ *   ./udp_scanner_bench                 run everything
+ *   ./udp_scanner_bench checksum json   run benchmarks whose name matches
+ *   ./udp_scanner_bench -n 5000000      operations per round
+ *   ./udp_scanner_bench -H inflight     engine tables on huge pages
+ *
+ * Every benchmark runs BENCH_ROUNDS rounds and reports the fastest, in
+ * nanoseconds and (on x86) TSC cycles per operation.
+ */
+
+#define UDP_SCANNER_NO_MAIN
+#include "udp_scanner.c"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#define BENCH_ROUNDS 5
+#define BENCH_DEFAULT_OPS 2000000
+#define BENCH_SEED 0x9E3779B97F4A7C15ULL
+#define CORPUS_SIZE 4096            /* Power of two: indexed with a mask */
+#define CORPUS_MASK (CORPUS_SIZE - 1)
+
+typedef struct {
+    const char *name;
+    void (*setup)(void);
+    uint64_t (*run)(uint64_t ops);  /* Returns a value derived from every result */
+} microbench_t;
+
+static uint64_t rng_state = BENCH_SEED;
+
+/* xorshift64*: fast, and identical on every run for a given seed */
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t bench_cycles(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Corpora, filled by the setup functions */
+static int ports[CORPUS_SIZE];
+static unsigned char packets[CORPUS_SIZE][64];
+static size_t packet_lens[CORPUS_SIZE];
+static scan_result_t results[CORPUS_SIZE];
+static unsigned char payload_small[64];
+static unsigned char payload_mtu[1472];
+
+/* Half the lookups hit the probe table, half miss it */
+static void setup_ports(void) {
+    int table = 0;
+
+    while (udp_probes[table].service_name != NULL)
+        table++;
+    for (int i = 0; i < CORPUS_SIZE; i++) {
+        if (rng_next() & 1)
+            ports[i] = udp_probes[rng_next() % table].port;
+        else
+            ports[i] = 1 + rng_next() % 65535;
+    }
+}
+
+static uint64_t run_probe_lookup(uint64_t ops) {
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < ops; i++)
+        acc += (uintptr_t)get_probe_for_port(ports[i & CORPUS_MASK]);
+    return acc;
+}
+
+static void setup_payloads(void) {
+    for (size_t i = 0; i < sizeof(payload_small); i++)
+        payload_small[i] = rng_next();
+    for (size_t i = 0; i < sizeof(payload_mtu); i++)
+        payload_mtu[i] = rng_next();
+}
+
+static uint64_t run_checksum_64(uint64_t ops) {
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < ops; i++) {
+        payload_small[0] = i;
+        acc += checksum(payload_small, sizeof(payload_small));
+    }
+    return acc;
+}
+
+static uint64_t run_checksum_1472(uint64_t ops) {
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < ops; i++) {
+        payload_mtu[0] = i;
+        acc += checksum(payload_mtu, sizeof(payload_mtu));
+    }
+    return acc;
+}
+
+/*
+ * What the raw ICMP socket delivers while scanning: mostly port
+ * unreachables, some other unreachable codes, unrelated ICMP (echo
+ * replies) and the odd truncated packet.
+ */
+static void setup_packets(void) {
+    for (int i = 0; i < CORPUS_SIZE; i++) {
+        unsigned char *p = packets[i];
+        struct ip *ip_hdr = (struct ip *)p;
+        struct icmp *icmp_hdr = (struct icmp *)(p + sizeof(struct ip));
+        unsigned kind = rng_next() % 100;
+
+        memset(p, 0, sizeof(packets[i]));
+        ip_hdr->ip_v = 4;
+        ip_hdr->ip_hl = sizeof(struct ip) >> 2;
+        ip_hdr->ip_p = IPPROTO_ICMP;
+        packet_lens[i] = sizeof(struct ip) + ICMP_MINLEN + sizeof(struct ip) + 8;
+
+        if (kind < 80) {
+            icmp_hdr->icmp_type = ICMP_UNREACH;
+            icmp_hdr->icmp_code = ICMP_UNREACH_PORT;
+        } else if (kind < 90) {
+            icmp_hdr->icmp_type = ICMP_UNREACH;
+            icmp_hdr->icmp_code = (uint8_t[]){ 1, 2, 9, 10, 13 }[rng_next() % 5];
+        } else if (kind < 98) {
+            icmp_hdr->icmp_type = ICMP_ECHOREPLY;
+        } else {
+            packet_lens[i] = 1 + rng_next() % (sizeof(struct ip) + ICMP_MINLEN - 1);
+        }
+    }
+}
+
+static uint64_t run_classify_icmp(uint64_t ops) {
+    scan_result_t r;
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < ops; i++) {
+        unsigned j = i & CORPUS_MASK;
+        acc += classify_icmp(packets[j], packet_lens[j], &r) + 1;
+    }
+    return acc;
+}
+
+/* Results in the proportions a large scan of a filtered host produces */
+static void setup_results(void) {
+    int table = 0;
+
+    while (udp_probes[table].service_name != NULL)
+        table++;
+    for (int i = 0; i < CORPUS_SIZE; i++) {
+        scan_result_t *r = &results[i];
+        unsigned kind = rng_next() % 100;
+        int id = rng_next() % (table + 1);
+
+        memset(r, 0, sizeof(*r));
+        r->target.s_addr = htonl(0x0A000000 | (rng_next() & 0xFFFFFF));
+        r->port = 1 + rng_next() % 65535;
+        r->probe_id = id;
+        r->service_name = id < table ? udp_probes[id].service_name : NULL;
+        r->probe_name = id < table ? udp_probes[id].probe_name : "empty";
+        r->rtt_usec = -1;
+        r->icmp_type = -1;
+        r->icmp_code = -1;
+
+        if (kind < 5) {
+            r->state = PORT_OPEN;
+            r->bytes = 20 + rng_next() % 500;
+            r->rtt_usec = 100 + rng_next() % 50000;
+            r->rtt_source = RTT_SOURCE_KERNEL;
+            r->banner = "..........version.bind.....9.18.28";
+        } else if (kind < 60) {
+            r->state = PORT_CLOSED;
+            r->icmp_type = ICMP_UNREACH;
+            r->icmp_code = ICMP_UNREACH_PORT;
+            r->rtt_usec = 100 + rng_next() % 50000;
+            r->rtt_source = RTT_SOURCE_KERNEL;
+        } else if (kind < 65) {
+            r->state = PORT_FILTERED;
+            r->icmp_type = ICMP_UNREACH;
+            r->icmp_code = 13;
+            r->rtt_usec = 100 + rng_next() % 50000;
+        } else {
+            r->state = PORT_OPEN_FILTERED;
+        }
+    }
+}
+
+static char format_buf[1024];
+static output_sink_t format_sink;
+
+static uint64_t run_format(uint64_t ops, int (*fn)(output_sink_t *, const scan_result_t *, char *, size_t)) {
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < ops; i++)
+        acc += fn(&format_sink, &results[i & CORPUS_MASK], format_buf, sizeof(format_buf));
+    return acc;
+}
+
+static uint64_t run_format_json(uint64_t ops) { return run_format(ops, format_json); }
+static uint64_t run_format_text(uint64_t ops) { return run_format(ops, format_text); }
+static uint64_t run_format_csv(uint64_t ops) { return run_format(ops, format_csv); }
+static uint64_t run_format_binary(uint64_t ops) { return run_format(ops, format_binary); }
+
+/* A baseline where a third of the ports are recently closed and some open */
+static void setup_baseline(void) {
+    uint32_t now = time(NULL);
+
+    config.baseline_max_age = BASELINE_MAX_AGE_HOURS * 3600L;
+    baseline = calloc(65536, sizeof(*baseline));
+    if (baseline == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int port = 1; port < 65536; port++) {
+        unsigned kind = rng_next() % 100;
+
+        if (kind < 33) {
+            baseline[port].known = 1;
+            baseline[port].state = PORT_CLOSED;
+            baseline[port].time = now - rng_next() % (48 * 3600);
+        } else if (kind < 36) {
+            baseline[port].known = 1;
+            baseline[port].state = PORT_OPEN;
+            baseline[port].time = now;
+            baseline[port].rtt_usec = 100 + rng_next() % 50000;
+        }
+    }
+}
+
+/* The per-port planning done by the main loop over a full 1-65535 range */
+static uint64_t run_port_plan(uint64_t ops) {
+    uint64_t acc = 0;
+    long timeout;
+
+    for (uint64_t i = 0; i < ops; i++) {
+        int port = 1 + i % 65535;
+        acc += baseline_plan(port, &timeout) + timeout;
+    }
+    return acc;
+}
+
+static void setup_flight(void) {
+    counters_register();
+}
+
+static uint64_t run_flight_record(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++)
+        flight_record(SCAN_EV_SEND, 0x0100007f, i & 0xFFFF, 0, 0, i);
+    return counter_get(&thread_counters->flight->recorded);
+}
+
+/* A reply's banner into the arena, released as each result is reported */
+static uint64_t run_banner_copy(uint64_t ops) {
+    uint64_t acc = 0;
+
+    arena_init(&thread_arena);
+    for (uint64_t i = 0; i < ops; i++) {
+        const char *b = banner_copy(&thread_arena, payload_mtu + (i & 63), 100);
+
+        acc += b[i & 31];
+        arena_release(&thread_arena);
+    }
+    return acc;
+}
+
+/*
+ * A million probes in flight, as at 500k probes/s with a 2 s timeout. The
+ * keys are walked in a shuffled ring so lookups land all over the table.
+ */
+#define INFLIGHT_BENCH_PROBES (1u << 20)
+
+static inflight_table_t bench_inflight;
+static uint32_t *inflight_keys;
+
+static inline uint32_t inflight_key_addr(uint32_t k) { return htonl(0x0a000000 | (k >> 4)); }
+static inline int inflight_key_port(uint32_t k) { return 1 + (k & 15) * 4001; }
+
+static void setup_inflight(void) {
+    if (bench_inflight.slots != NULL)
+        return;
+    inflight_keys = malloc(INFLIGHT_BENCH_PROBES * sizeof(*inflight_keys));
+    if (inflight_keys == NULL || inflight_init(&bench_inflight, 500000, 2000000) < 0) {
+        perror("in-flight table");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < INFLIGHT_BENCH_PROBES; i++)
+        inflight_keys[i] = i;
+    for (uint32_t i = INFLIGHT_BENCH_PROBES - 1; i > 0; i--) {
+        uint32_t j = rng_next() % (i + 1), k = inflight_keys[i];
+        inflight_keys[i] = inflight_keys[j];
+        inflight_keys[j] = k;
+    }
+    for (uint32_t i = 0; i < INFLIGHT_BENCH_PROBES; i++) {
+        uint32_t k = inflight_keys[i];
+        inflight_insert(&bench_inflight, inflight_key_addr(k), inflight_key_port(k), k & 7);
+    }
+}
+
+/* The lookup every response does */
+static uint64_t run_inflight_find(uint64_t ops) {
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < ops; i++) {
+        uint32_t k = inflight_keys[i & (INFLIGHT_BENCH_PROBES - 1)];
+        acc += inflight_find(&bench_inflight, inflight_key_addr(k), inflight_key_port(k),
+                             k & 7) != NULL;
+    }
+    return acc;
+}
+
+/* An answered probe leaves the table and the next one takes its place */
+static uint64_t run_inflight_churn(uint64_t ops) {
+    uint64_t acc = 0;
+
+    for (uint64_t i = 0; i < ops; i++) {
+        uint32_t k = inflight_keys[i & (INFLIGHT_BENCH_PROBES - 1)];
+        inflight_entry_t *e = inflight_find(&bench_inflight, inflight_key_addr(k),
+                                            inflight_key_port(k), k & 7);
+
+        acc += e->attempt;
+        inflight_remove(&bench_inflight, e);
+        e = inflight_insert(&bench_inflight, inflight_key_addr(k), inflight_key_port(k), k & 7);
+        e->attempt = i & 1;
+    }
+    return acc + bench_inflight.count;
+}
+
+static const microbench_t benchmarks[] = {
+    { "probe_lookup",  setup_ports,    run_probe_lookup },
+    { "checksum_64",   setup_payloads, run_checksum_64 },
+    { "checksum_1472", setup_payloads, run_checksum_1472 },
+    { "classify_icmp", setup_packets,  run_classify_icmp },
+    { "format_json",   setup_results,  run_format_json },
+    { "format_text",   setup_results,  run_format_text },
+    { "format_csv",    setup_results,  run_format_csv },
+    { "format_binary", setup_results,  run_format_binary },
+    { "port_plan",     setup_baseline, run_port_plan },
+    { "flight_record", setup_flight,   run_flight_record },
+    { "banner_copy",   setup_payloads, run_banner_copy },
+    { "inflight_find", setup_inflight, run_inflight_find },
+    { "inflight_churn", setup_inflight, run_inflight_churn },
+    { NULL, NULL, NULL }
+};
+
+static int selected(const char *name, char **filters, int count) {
+    if (count == 0)
+        return 1;
+    for (int i = 0; i < count; i++) {
+        if (strstr(name, filters[i]) != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t ops = BENCH_DEFAULT_OPS;
+    volatile uint64_t sink = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:Hh")) != -1) {
+        switch (opt) {
+        case 'n':
+            ops = strtoull(optarg, NULL, 10);
+            if (ops == 0) {
+                fprintf(stderr, "Error: Invalid operation count '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'H':
+            config.huge_pages = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n ops] [-H] [benchmark...]\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    printf("%-16s %12s %10s %10s\n", "Benchmark", "Ops", "ns/op", "cycles/op");
+    for (const microbench_t *b = benchmarks; b->name != NULL; b++) {
+        double best_ns = 0, best_cycles = 0;
+
+        if (!selected(b->name, argv + optind, argc - optind))
+            continue;
+
+        rng_state = BENCH_SEED;
+        b->setup();
+        sink += b->run(ops / 10);               /* Warm caches and branch predictors */
+
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            uint64_t t0 = bench_now_ns(), c0 = bench_cycles();
+            sink += b->run(ops);
+            uint64_t c1 = bench_cycles(), t1 = bench_now_ns();
+            double ns = (double)(t1 - t0) / ops;
+            double cycles = (double)(c1 - c0) / ops;
+
+            if (round == 0 || ns < best_ns) {
+                best_ns = ns;
+                best_cycles = cycles;
+            }
+        }
+
+#ifdef HAVE_TSC
+        printf("%-16s %12llu %10.2f %10.1f\n", b->name, (unsigned long long)ops, best_ns, best_cycles);
+#else
+        (void)best_cycles;
+        printf("%-16s %12llu %10.2f %10s\n", b->name, (unsigned long long)ops, best_ns, "-");
+#endif
+    }
+
+    engine_tables_report();
+    return sink == 0xFFFFFFFFFFFFFFFFULL;       /* Keep the results alive */
+}
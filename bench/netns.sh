@@ -0,0 +1,131 @@
+#!/bin/bash
+#
+# Network-namespace benchmark suite
+# Author: Mikkel Andersen
+# License: MIT
+#
+# Connects two network namespaces with a veth pair, runs udp_responder in
+# the target namespace and scans it under a series of tc netem profiles and
+# ICMP rate limits. Each run prints one row: throughput, accuracy and the
+# share of closed or open ports wrongly reported as open|filtered, so
+# regressions in timeout, retry and pacing logic show up as numbers.
+#
+# Usage: sudo bench/netns.sh [start_port] [end_port] [step]
+#
+# Environment:
+#   PROFILES     profile names to run (default: all below)
+#   RATELIMITS   net.ipv4.icmp_ratelimit values in ms for the target
+#                namespace (default: "0 1000"; 0 disables, 1000 is the
+#                Linux default)
+#   RESULTS      append CSV rows to this file as well
+#
+
+set -e
+
+START=${1:-1}
+END=${2:-200}
+STEP=${3:-10}
+SEED=1
+
+# netem parameters per profile, applied to each direction, so delay and
+# loss compound over a probe/reply round trip: "lan" and "wan" add about
+# 0.4 ms and 40 ms of RTT, "loss5" loses about 5% of round trips (2.5% each
+# way) and "rtt300" adds 300 ms of RTT. "veth" is the bare link without netem
+declare -A NETEM=(
+    [veth]=""
+    [lan]="delay 200us 50us"
+    [wan]="delay 20ms 5ms"
+    [loss5]="delay 1ms loss 2.5%"
+    [rtt300]="delay 150ms 10ms"
+)
+PROFILES=${PROFILES:-"veth lan wan loss5 rtt300"}
+RATELIMITS=${RATELIMITS:-"0 1000"}
+
+NS_SCAN=udpscan-bench-src
+NS_TARGET=udpscan-bench-dst
+SCAN_ADDR=10.199.0.1
+TARGET_ADDR=10.199.0.2
+
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+RESPONDER_PID=
+
+teardown() {
+    ip netns del $NS_SCAN 2>/dev/null || true
+    ip netns del $NS_TARGET 2>/dev/null || true
+}
+
+cleanup() {
+    [ -n "$RESPONDER_PID" ] && kill $RESPONDER_PID 2>/dev/null
+    teardown
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "Error: needs root to create namespaces" >&2
+    exit 1
+fi
+
+in_scan() { ip netns exec $NS_SCAN "$@"; }
+in_target() { ip netns exec $NS_TARGET "$@"; }
+
+# Set the netem profile on one end of the link
+shape() {
+    ip netns exec $1 tc qdisc del dev $2 root 2>/dev/null || true
+    if [ -n "$3" ]; then
+        ip netns exec $1 tc qdisc add dev $2 root netem $3
+    fi
+}
+
+teardown
+ip netns add $NS_SCAN
+ip netns add $NS_TARGET
+ip link add veth-scan netns $NS_SCAN type veth peer name veth-target netns $NS_TARGET
+in_scan ip addr add $SCAN_ADDR/24 dev veth-scan
+in_target ip addr add $TARGET_ADDR/24 dev veth-target
+in_scan ip link set lo up
+in_target ip link set lo up
+in_scan ip link set veth-scan up
+in_target ip link set veth-target up
+
+in_target "$DIR/udp_responder" -a $TARGET_ADDR -e -s $SEED \
+    -p "$(seq -s, "$START" "$STEP" "$END")" > "$WORK/responder.log" &
+RESPONDER_PID=$!
+sleep 0.5
+
+if [ -n "$RESULTS" ] && [ ! -s "$RESULTS" ]; then
+    echo "time,icmp_ratelimit,profile,ports,probes,seconds,probes_per_sec,accuracy,false_open_filtered,cpu_usec_per_probe" > "$RESULTS"
+fi
+
+printf "%-10s %7s %8s %9s %10s %10s %9s %8s\n" \
+       "Profile" "Ports" "Probes" "Time (s)" "Probes/s" "Accuracy" "False O|F" "CPU us"
+
+for ratelimit in $RATELIMITS; do
+    in_target sysctl -qw net.ipv4.icmp_ratelimit=$ratelimit
+    echo "-- icmp_ratelimit=${ratelimit}ms"
+
+    for profile in $PROFILES; do
+        if [ -z "${NETEM[$profile]+set}" ]; then
+            echo "Error: unknown profile '$profile'" >&2
+            exit 1
+        fi
+        if ! shape $NS_SCAN veth-scan "${NETEM[$profile]}" ||
+           ! shape $NS_TARGET veth-target "${NETEM[$profile]}"; then
+            echo "Error: tc netem failed (is sch_netem available?)" >&2
+            exit 1
+        fi
+
+        TIMEFORMAT='%U %S'
+        { time in_scan "$DIR/udp_scanner" -j "$WORK/scan.jsonl" $TARGET_ADDR "$START" "$END" \
+            > "$WORK/scan.log" 2> "$WORK/scan.err" ; } 2> "$WORK/cpu"
+
+        row=$(awk -v start="$START" -v step="$STEP" -v cpu="$(cat "$WORK/cpu")" \
+                  -v label="$profile" -f "$DIR/bench/report.awk" \
+                  "$WORK/scan.jsonl" "$WORK/scan.log")
+        echo "$row"
+        if [ -n "$RESULTS" ]; then
+            echo "$(date +%s),$ratelimit,$row" | awk '{ $1 = $1; print }' OFS=, >> "$RESULTS"
+        fi
+    done
+done
@@ -0,0 +1,48 @@
+#
+# Benchmark report: compares a scan's JSON Lines output with the
+# responder's ground truth and summarises the run
+# Author: Mikkel Andersen
+# License: MIT
+#
+# Usage: awk -v start=S -v step=N -v cpu="USER SYS" [-v label=L] \
+#            -f report.awk scan.jsonl scan.log
+#
+# Ports start, start+step, ... are served by udp_responder -e and must be
+# open; every other port is unbound and must be closed. With label set, one
+# table row is printed instead of the full summary.
+#
+
+FILENAME ~ /\.jsonl$/ {
+    port = $0; sub(/.*"port":/, "", port); sub(/,.*/, "", port)
+    state = $0; sub(/.*"state":"/, "", state); sub(/".*/, "", state)
+    expected = ((port - start) % step == 0) ? "open" : "closed"
+    total++
+    if (state == expected) correct++
+    else if (state == "open|filtered") false_of++
+    else wrong++
+    next
+}
+/^Probes sent:/   { probes = $3 }
+/^Scan duration:/ { duration = $3 }
+END {
+    split(cpu, t, " ")
+    if (total == 0 || probes == 0 || duration == 0) {
+        print "Error: scan produced no results" > "/dev/stderr"
+        exit 1
+    }
+    if (label != "") {
+        printf "%-10s %7d %8d %9.2f %10.1f %9.2f%% %8.2f%% %8.1f\n",
+               label, total, probes, duration, probes / duration,
+               100 * correct / total, 100 * false_of / total,
+               1e6 * (t[1] + t[2]) / probes
+        exit 0
+    }
+    printf "Ports:              %d\n", total
+    printf "Probes sent:        %d\n", probes
+    printf "Duration:           %.2f s\n", duration
+    printf "Throughput:         %.1f probes/s\n", probes / duration
+    printf "Accuracy:           %.2f%% (%d false open|filtered, %d wrong)\n",
+           100 * correct / total, false_of, wrong
+    printf "CPU per probe:      %.1f us (user %.2f s, sys %.2f s)\n",
+           1e6 * (t[1] + t[2]) / probes, t[1], t[2]
+}
@@ -0,0 +1,283 @@
+/*
+ * Binary Result Log and Scan History Formats
+ * Author: Mikkel Andersen
+ * License: MIT
+ *
+ * Shared by udp_scanner (writer), udp_scan_convert and udp_scan_history
+ * (readers). The port state store and flight recorder dump formats are
+ * defined at the end.
+ *
+ * Layout:
+ *   scan_log_header_t                 fixed 32 bytes
+ *   scan_log_probe_t[probe_count]     probe id -> service/probe name
+ *   scan_log_record_t[...]            fixed-size records from header_size on
+ *
+ * Files are opened with O_APPEND and only ever grow by whole records, so
+ * several scans can append to the same log and readers can mmap it and
+ * index records directly. Integers are stored in the writer's byte order;
+ * byte_order lets readers reject logs produced on a different host type.
+ */
+
+#ifndef SCAN_RECORD_H
+#define SCAN_RECORD_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define SCAN_LOG_MAGIC "UDPSCLOG"
+#define SCAN_LOG_VERSION 1
+#define SCAN_LOG_BYTE_ORDER 0x01020304u
+
+/* Port states, numbered as the scanner's port_state_t */
+#define SCAN_STATE_OPEN 0
+#define SCAN_STATE_OPEN_FILTERED 1
+#define SCAN_STATE_CLOSED 2
+#define SCAN_STATE_FILTERED 3
+
+/* Record flags */
+#define SCAN_REC_UDP_REPLY 0x01   /* A UDP datagram came back from the port */
+#define SCAN_REC_ICMP 0x02        /* icmp_type/icmp_code are valid */
+#define SCAN_REC_RTT 0x04         /* rtt_usec is valid */
+#define SCAN_REC_RTT_KERNEL 0x08  /* rtt_usec comes from kernel TX/RX timestamps */
+#define SCAN_REC_RTT_HW 0x10      /* rtt_usec comes from NIC hardware timestamps */
+
+typedef struct {
+    char magic[8];
+    uint16_t version;
+    uint16_t header_size;       /* Offset of the first record */
+    uint16_t record_size;
+    uint16_t probe_count;
+    uint32_t byte_order;
+    uint32_t reserved;
+    uint64_t created;           /* Unix time the log was created */
+} scan_log_header_t;
+
+typedef struct {
+    char service[16];
+    char probe[24];
+} scan_log_probe_t;
+
+typedef struct {
+    uint32_t addr;              /* IPv4 address, network byte order */
+    uint32_t time;              /* Unix time the result became final */
+    uint32_t rtt_usec;
+    uint16_t port;
+    uint16_t probe_id;
+    uint16_t bytes;             /* UDP payload bytes, saturated at 65535 */
+    uint8_t state;
+    uint8_t flags;
+    uint8_t icmp_type;
+    uint8_t icmp_code;
+    uint16_t reserved;
+} scan_log_record_t;
+
+_Static_assert(sizeof(scan_log_header_t) == 32, "scan log header must stay 32 bytes");
+_Static_assert(sizeof(scan_log_record_t) == 24, "scan log records must stay 24 bytes");
+
+/* Offset of the first record for a log with probe_count probes */
+static inline size_t scan_log_header_size(unsigned probe_count) {
+    size_t size = sizeof(scan_log_header_t) + probe_count * sizeof(scan_log_probe_t);
+    return (size + 7) & ~(size_t)7;
+}
+
+/* Check the fixed header; returns NULL when valid or a reason otherwise */
+static inline const char *scan_log_check_header(const scan_log_header_t *h, size_t file_size) {
+    if (file_size < sizeof(*h) || memcmp(h->magic, SCAN_LOG_MAGIC, sizeof(h->magic)) != 0)
+        return "not a scan log";
+    if (h->byte_order != SCAN_LOG_BYTE_ORDER)
+        return "written on a host with different byte order";
+    if (h->version != SCAN_LOG_VERSION || h->record_size != sizeof(scan_log_record_t))
+        return "unsupported log version";
+    if (h->header_size != scan_log_header_size(h->probe_count) || h->header_size > file_size)
+        return "truncated header";
+    return NULL;
+}
+
+/* Sort key of a record: address in host order, then port */
+static inline uint64_t scan_record_key(const scan_log_record_t *rec) {
+    return ((uint64_t)ntohl(rec->addr) << 16) | rec->port;
+}
+
+/*
+ * Scan history store (udp_scanner --history <dir>)
+ *
+ * A directory holding one segment per scan plus an append-only manifest:
+ *
+ *   <dir>/manifest             scan_history_manifest_t, then one
+ *                              scan_history_entry_t per committed scan
+ *   <dir>/scan-<id>.log        scan log whose records are sorted by
+ *                              scan_record_key(), one record per port
+ *
+ * Segments are written first and committed by appending their manifest
+ * entry, so a crashed scan leaves an orphan segment that readers ignore.
+ * The sorted segment is the (address, port) index: lookups binary-search
+ * each mmap'd segment and diffs merge-join two of them.
+ */
+
+#define SCAN_HISTORY_MAGIC "UDPSCHST"
+#define SCAN_HISTORY_VERSION 1
+#define SCAN_HISTORY_MANIFEST "manifest"
+#define SCAN_HISTORY_SEGMENT_FMT "scan-%08u.log"
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+} scan_history_manifest_t;
+
+typedef struct {
+    uint32_t scan_id;
+    uint32_t target;            /* IPv4 address, network byte order */
+    uint64_t started;           /* Unix time */
+    uint64_t finished;
+    uint64_t records;
+    uint16_t start_port;
+    uint16_t end_port;
+    uint32_t reserved;
+} scan_history_entry_t;
+
+_Static_assert(sizeof(scan_history_manifest_t) == 16, "manifest header must stay 16 bytes");
+_Static_assert(sizeof(scan_history_entry_t) == 40, "manifest entries must stay 40 bytes");
+
+/*
+ * Port state store (udp_scanner --state <file>)
+ *
+ *   scan_state_header_t
+ *   scan_log_probe_t[probe_count] padded to SCAN_STATE_BITMAP_OFFSET
+ *   uint8_t[hosts * 16384]       two bits per port, host after host
+ *   scan_log_record_t[open_count] open ports, appended as they are found
+ *
+ * Hosts are the consecutive addresses from first_addr. Port p of a host is
+ * bits 2 * (p % 4) of its byte p / 4. The scanner maps the header and
+ * bitmap shared, so every finished port is on disk without a write call
+ * and an interrupted scan resumes where it stopped.
+ */
+
+#define SCAN_STATE_MAGIC "UDPSCPST"
+#define SCAN_STATE_VERSION 1
+#define SCAN_STATE_BITMAP_OFFSET 4096
+#define SCAN_STATE_HOST_BYTES (65536 / 4)
+
+/* Two-bit port slots; filtered ports are stored as open|filtered */
+#define SCAN_SLOT_UNSCANNED 0
+#define SCAN_SLOT_CLOSED 1
+#define SCAN_SLOT_OPEN 2
+#define SCAN_SLOT_OPEN_FILTERED 3
+
+typedef struct {
+    char magic[8];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t byte_order;
+    uint32_t hosts;
+    uint32_t first_addr;        /* IPv4 address, network byte order */
+    uint32_t open_count;        /* Records after the bitmap */
+    uint16_t probe_count;       /* Entries in the probe table after the header */
+    uint16_t reserved;
+    uint64_t created;           /* Unix time the store was created */
+} scan_state_header_t;
+
+_Static_assert(sizeof(scan_state_header_t) == 40, "state store header must stay 40 bytes");
+
+/* Offset of the open port records in a store of `hosts` hosts */
+static inline size_t scan_state_open_offset(uint32_t hosts) {
+    return SCAN_STATE_BITMAP_OFFSET + (size_t)hosts * SCAN_STATE_HOST_BYTES;
+}
+
+static inline unsigned scan_state_slot(const uint8_t *bitmap, uint32_t host, unsigned port) {
+    return bitmap[(size_t)host * SCAN_STATE_HOST_BYTES + port / 4] >> (port % 4 * 2) & 3;
+}
+
+/* NULL if the store header is usable, else why not */
+static inline const char *scan_state_check_header(const scan_state_header_t *h, size_t file_size) {
+    if (file_size < sizeof(*h) || memcmp(h->magic, SCAN_STATE_MAGIC, sizeof(h->magic)) != 0)
+        return "not a port state store";
+    if (h->byte_order != SCAN_LOG_BYTE_ORDER)
+        return "written on a host with different byte order";
+    if (h->version != SCAN_STATE_VERSION || h->record_size != sizeof(scan_log_record_t))
+        return "unsupported store version";
+    if (sizeof(*h) + (size_t)h->probe_count * sizeof(scan_log_probe_t) > SCAN_STATE_BITMAP_OFFSET)
+        return "corrupt probe table";
+    if (h->hosts == 0 || file_size < scan_state_open_offset(h->hosts) +
+                                     (size_t)h->open_count * sizeof(scan_log_record_t))
+        return "truncated store";
+    return NULL;
+}
+
+static inline const char *scan_slot_name(unsigned slot) {
+    static const char *const names[] = { "unscanned", "closed", "open", "open|filtered" };
+    return names[slot & 3];
+}
+
+/*
+ * Flight recorder dump (written by udp_scanner on SIGUSR1 or a fatal signal)
+ *
+ *   scan_flight_header_t
+ *   per scanning thread: scan_flight_thread_t, then its newest events
+ *                        (scan_flight_event_t) oldest first
+ *
+ * Event times are raw clock ticks (the TSC on x86); the header pairs the
+ * clock with wall time at the dump so readers can convert them.
+ */
+
+#define SCAN_FLIGHT_MAGIC "UDPSCFLT"
+#define SCAN_FLIGHT_VERSION 1
+
+/* Event types; aux and arg depend on the type */
+#define SCAN_EV_SEND 1          /* aux: attempt, arg: timeout (us) */
+#define SCAN_EV_UDP_REPLY 2     /* arg: RTT (us) */
+#define SCAN_EV_ICMP 3          /* aux: ICMP unreachable code, arg: RTT (us) */
+#define SCAN_EV_TIMEOUT 4       /* aux: attempt, arg: timeout (us) */
+#define SCAN_EV_RESULT 5        /* aux: final state, arg: RTT (us) or -1 */
+#define SCAN_EV_RTO 6           /* arg: new probe timeout (us) */
+#define SCAN_EV_SEND_ERROR 7    /* aux: attempt, arg: errno */
+
+typedef struct {
+    char magic[8];
+    uint16_t version;
+    uint16_t event_size;
+    uint32_t byte_order;
+    uint32_t signal;            /* Signal that triggered the dump */
+    uint32_t threads;
+    uint64_t clock_hz;          /* Event clock ticks per second */
+    uint64_t clock_now;         /* Event clock at the dump ... */
+    uint64_t realtime_ns;       /* ... and wall time then, ns since the epoch */
+} scan_flight_header_t;
+
+typedef struct {
+    uint32_t tid;               /* Kernel thread id */
+    uint32_t events;            /* Events that follow */
+    uint64_t recorded;          /* Events recorded; all but the last `events` were overwritten */
+} scan_flight_thread_t;
+
+typedef struct {
+    uint64_t clock;
+    int64_t arg;
+    uint32_t addr;              /* IPv4 address, network byte order */
+    uint16_t port;
+    uint16_t probe_id;
+    uint8_t type;
+    uint8_t aux;
+    uint8_t reserved[6];
+} scan_flight_event_t;
+
+_Static_assert(sizeof(scan_flight_header_t) == 48, "flight header must stay 48 bytes");
+_Static_assert(sizeof(scan_flight_thread_t) == 16, "flight thread header must stay 16 bytes");
+_Static_assert(sizeof(scan_flight_event_t) == 32, "flight events must stay 32 bytes");
+
+static inline const char *scan_flight_event_name(unsigned type) {
+    static const char *const names[] = {
+        "unknown", "send", "udp-reply", "icmp", "timeout", "result", "rto", "send-error"
+    };
+    return type < sizeof(names) / sizeof(names[0]) ? names[type] : "unknown";
+}
+
+static inline const char *scan_state_name(unsigned state) {
+    static const char *const names[] = {
+        "open", "open|filtered", "closed", "filtered"
+    };
+    return state < sizeof(names) / sizeof(names[0]) ? names[state] : "unknown";
+}
+
+#endif /* SCAN_RECORD_H */
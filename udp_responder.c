@@ -0,0 +1,635 @@
+/*
+ * Loopback UDP Service Simulator
+ * Author: Mikkel Andersen
+ * License: MIT
+ *
+ * Binds many UDP ports on one address and answers the scanner's probes the
+ * way real services would: DNS, NTP, SNMP, DHCP, NetBIOS, SIP and SSDP
+ * requests get protocol-correct replies, chosen by payload rather than by
+ * port. Ports that are not bound are closed; the kernel answers them with
+ * ICMP port unreachable exactly as a real host does. A seeded fraction of
+ * requests can be dropped to model loss or filtering.
+ *
+ * Gives the scanner a reproducible target for throughput and accuracy
+ * benchmarks (see bench/loopback.sh).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_PACKET_SIZE 65536
+#define EPOLL_BATCH 64
+#define REPLY_MAX 4096                  /* Largest reply serve_socket() sends */
+#define NTP_UNIX_OFFSET 2208988800UL    /* Seconds from 1900 to 1970 */
+
+/* Ports bound when no -p list is given: the scanner's probe table */
+static const char default_ports[] = "53,67,68,69,123,137,138,161,514,520,1900,5060";
+
+typedef enum {
+    SVC_NONE,
+    SVC_DNS,
+    SVC_NTP,
+    SVC_SNMP,
+    SVC_DHCP,
+    SVC_NETBIOS,
+    SVC_SIP,
+    SVC_SSDP,
+    SVC_ECHO,
+    SVC_COUNT
+} service_t;
+
+static const char *const service_names[SVC_COUNT] = {
+    "silent", "dns", "ntp", "snmp", "dhcp", "netbios", "sip", "ssdp", "echo"
+};
+
+typedef struct {
+    unsigned long requests;
+    unsigned long replies[SVC_COUNT];
+    unsigned long dropped;
+} responder_stats_t;
+
+static responder_stats_t stats;
+static volatile sig_atomic_t stopping = 0;
+static uint64_t rng_state;
+
+/* Command line options */
+typedef struct {
+    struct in_addr addr;
+    const char *ports;
+    double drop;                /* Fraction of requests ignored */
+    int echo;                   /* Answer empty and unknown payloads too */
+    int verbose;
+} responder_config_t;
+
+static responder_config_t config = {
+    .ports = default_ports
+};
+
+static void handle_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+/* xorshift64*: fixed-seed, so drop decisions repeat between runs */
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double rng_uniform(void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Skip a DNS/NetBIOS name; returns the offset after it or -1 */
+static int skip_name(const unsigned char *p, int len, int off) {
+    while (off < len) {
+        unsigned label = p[off];
+
+        if (label == 0)
+            return off + 1;
+        if ((label & 0xc0) == 0xc0)
+            return off + 2 <= len ? off + 2 : -1;
+        off += label + 1;
+    }
+    return -1;
+}
+
+/* DNS: answer the first question with a TXT record (version.bind style) */
+static int reply_dns(const unsigned char *req, int len, unsigned char *out, int size) {
+    static const char version[] = "9.18.0-udp_responder";
+    int qend = skip_name(req, len, 12);
+    int n;
+
+    if (qend < 0 || qend + 4 > len)
+        return -1;
+    qend += 4;
+    /* The question is echoed: a long one must not overrun the reply buffer */
+    if (qend + 2 + 2 + 2 + 4 + 2 + 1 + (int)sizeof(version) - 1 > size)
+        return -1;
+
+    memcpy(out, req, qend);
+    out[2] = 0x84 | (req[2] & 0x01);    /* QR, AA, copy RD */
+    out[3] = 0x00;
+    out[4] = 0x00; out[5] = 0x01;       /* QDCOUNT */
+    out[6] = 0x00; out[7] = 0x01;       /* ANCOUNT */
+    memset(out + 8, 0, 4);
+    n = qend;
+
+    out[n++] = 0xc0; out[n++] = 0x0c;   /* Name: pointer to the question */
+    out[n++] = 0x00; out[n++] = 0x10;   /* TXT */
+    out[n++] = req[qend - 2];           /* Class copied from the question */
+    out[n++] = req[qend - 1];
+    memset(out + n, 0, 4);              /* TTL */
+    n += 4;
+    out[n++] = 0x00;
+    out[n++] = sizeof(version);         /* RDLENGTH: length byte + text */
+    out[n++] = sizeof(version) - 1;
+    memcpy(out + n, version, sizeof(version) - 1);
+    return n + sizeof(version) - 1;
+}
+
+static void ntp_timestamp(unsigned char *out, const struct timespec *ts) {
+    uint32_t sec = (uint32_t)(ts->tv_sec + NTP_UNIX_OFFSET);
+    uint32_t frac = (uint32_t)(((uint64_t)ts->tv_nsec << 32) / 1000000000UL);
+
+    sec = htonl(sec);
+    frac = htonl(frac);
+    memcpy(out, &sec, 4);
+    memcpy(out + 4, &frac, 4);
+}
+
+/* NTP: server-mode reply echoing the client's transmit timestamp */
+static int reply_ntp(const unsigned char *req, int len, unsigned char *out) {
+    struct timespec now;
+
+    (void)len;
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(out, 0, 48);
+    out[0] = (req[0] & 0x38) | 0x04;    /* LI 0, client's version, mode 4 */
+    out[1] = 2;                         /* Stratum */
+    out[2] = req[2] ? req[2] : 6;       /* Poll */
+    out[3] = (unsigned char)-20;        /* Precision: ~1 us */
+    memcpy(out + 12, "LOCL", 4);        /* Reference ID */
+    ntp_timestamp(out + 16, &now);      /* Reference */
+    memcpy(out + 24, req + 40, 8);      /* Originate = client transmit */
+    ntp_timestamp(out + 32, &now);      /* Receive */
+    ntp_timestamp(out + 40, &now);      /* Transmit */
+    return 48;
+}
+
+/* Length of a BER TLV at off (short and one/two-byte long form); -1 if bad */
+static int ber_tlv_len(const unsigned char *p, int len, int off, int *hdr) {
+    int l;
+
+    if (off + 2 > len)
+        return -1;
+    l = p[off + 1];
+    *hdr = 2;
+    if (l == 0x81 && off + 3 <= len) {
+        l = p[off + 2];
+        *hdr = 3;
+    } else if (l == 0x82 && off + 4 <= len) {
+        l = (p[off + 2] << 8) | p[off + 3];
+        *hdr = 4;
+    } else if (l & 0x80) {
+        return -1;
+    }
+    return off + *hdr + l <= len ? l : -1;
+}
+
+/* Write a BER length (short form, or one/two-byte long form); returns bytes */
+static int ber_put_len(unsigned char *p, int l) {
+    if (l < 0x80) {
+        p[0] = l;
+        return 1;
+    }
+    if (l < 0x100) {
+        p[0] = 0x81;
+        p[1] = l;
+        return 2;
+    }
+    p[0] = 0x82;
+    p[1] = l >> 8;
+    p[2] = l & 0xff;
+    return 3;
+}
+
+/* SNMP: GetResponse carrying sysDescr.0 for the request's id and community */
+static int reply_snmp(const unsigned char *req, int len, unsigned char *out) {
+    static const unsigned char sys_descr_oid[] = {
+        0x06, 0x08, 0x2b, 0x06, 0x01, 0x02, 0x01, 0x01, 0x01, 0x00
+    };
+    static const char descr[] = "udp_responder simulated SNMP agent";
+    int off = 0, hdr, l;
+    int version_off, version_len, community_off, community_len, id_off, id_len;
+    unsigned char varbind[128];
+    unsigned char pdu[192];
+    int vb, pl, n;
+
+    /* Message SEQUENCE, then version and community */
+    if (ber_tlv_len(req, len, off, &hdr) < 0)
+        return -1;
+    off += hdr;
+    version_off = off;
+    if ((l = ber_tlv_len(req, len, off, &hdr)) < 0 || req[off] != 0x02)
+        return -1;
+    version_len = hdr + l;
+    off += version_len;
+    community_off = off;
+    if ((l = ber_tlv_len(req, len, off, &hdr)) < 0 || req[off] != 0x04)
+        return -1;
+    community_len = hdr + l;
+    off += community_len;
+
+    /* Request PDU, then request-id */
+    if (ber_tlv_len(req, len, off, &hdr) < 0 || (req[off] & 0xe0) != 0xa0)
+        return -1;
+    off += hdr;
+    id_off = off;
+    if ((l = ber_tlv_len(req, len, off, &hdr)) < 0 || req[off] != 0x02)
+        return -1;
+    id_len = hdr + l;
+    if (version_len + community_len + id_len > 64)
+        return -1;
+
+    /* VarBind ::= SEQUENCE { OID, OCTET STRING } */
+    vb = 0;
+    varbind[vb++] = 0x30;
+    varbind[vb++] = sizeof(sys_descr_oid) + 2 + sizeof(descr) - 1;
+    memcpy(varbind + vb, sys_descr_oid, sizeof(sys_descr_oid));
+    vb += sizeof(sys_descr_oid);
+    varbind[vb++] = 0x04;
+    varbind[vb++] = sizeof(descr) - 1;
+    memcpy(varbind + vb, descr, sizeof(descr) - 1);
+    vb += sizeof(descr) - 1;
+
+    /* GetResponse-PDU: request-id, error-status 0, error-index 0, varbinds */
+    pl = 0;
+    memcpy(pdu + pl, req + id_off, id_len);
+    pl += id_len;
+    memcpy(pdu + pl, "\x02\x01\x00\x02\x01\x00", 6);
+    pl += 6;
+    pdu[pl++] = 0x30;
+    pl += ber_put_len(pdu + pl, vb);
+    memcpy(pdu + pl, varbind, vb);
+    pl += vb;
+
+    n = 0;
+    /* Echoed fields can push the message past 127 bytes: long-form lengths */
+    out[n++] = 0x30;
+    n += ber_put_len(out + n, version_len + community_len +
+                     1 + (pl < 0x80 ? 1 : 2) + pl);
+    memcpy(out + n, req + version_off, version_len);
+    n += version_len;
+    memcpy(out + n, req + community_off, community_len);
+    n += community_len;
+    out[n++] = 0xa2;
+    n += ber_put_len(out + n, pl);
+    memcpy(out + n, pdu, pl);
+    return n + pl;
+}
+
+/* DHCP: DHCPOFFER for a DISCOVER, keeping the transaction and client MAC */
+static int reply_dhcp(const unsigned char *req, int len, unsigned char *out) {
+    static const unsigned char options[] = {
+        0x35, 0x01, 0x02,                           /* DHCP Offer */
+        0x36, 0x04, 10, 0, 0, 1,                    /* Server identifier */
+        0x33, 0x04, 0x00, 0x00, 0x0e, 0x10,         /* Lease time: 3600 s */
+        0x01, 0x04, 255, 255, 255, 0,               /* Subnet mask */
+        0x03, 0x04, 10, 0, 0, 1,                    /* Router */
+        0xff
+    };
+
+    if (len < 240)
+        return -1;
+    memcpy(out, req, 240);              /* BOOTP header and magic cookie */
+    out[0] = 0x02;                      /* BOOTREPLY */
+    memcpy(out + 16, "\x0a\x00\x00\x64", 4);    /* yiaddr 10.0.0.100 */
+    memcpy(out + 20, "\x0a\x00\x00\x01", 4);    /* siaddr 10.0.0.1 */
+    memcpy(out + 240, options, sizeof(options));
+    return 240 + sizeof(options);
+}
+
+/* NetBIOS: node status (NBSTAT) or positive name query response */
+static int reply_netbios(const unsigned char *req, int len, unsigned char *out, int size) {
+    static const char name[15] = "UDPRESPONDER   ";
+    int qend = skip_name(req, len, 12);
+    int n;
+
+    if (qend < 0 || qend + 4 > len)
+        return -1;
+    /* Echoed name plus type, class, TTL and the larger (NBSTAT) answer */
+    if (qend + 2 + 2 + 4 + 2 + 1 + 18 + 46 > size)
+        return -1;
+
+    memcpy(out, req, 2);                /* Transaction ID */
+    out[2] = 0x84; out[3] = 0x00;       /* Response, authoritative */
+    memcpy(out + 4, "\x00\x00\x00\x01\x00\x00\x00\x00", 8);
+    n = 12;
+    memcpy(out + n, req + 12, qend - 12);
+    n += qend - 12;
+    out[n++] = req[qend];               /* Type: copied (NB or NBSTAT) */
+    out[n++] = req[qend + 1];
+    out[n++] = 0x00; out[n++] = 0x01;   /* Class IN */
+    memset(out + n, 0, 4);              /* TTL */
+    n += 4;
+
+    if (req[qend + 1] == 0x21) {
+        /* NBSTAT: one name entry, then MAC and zeroed statistics */
+        int rdlen = 1 + 18 + 46;
+
+        out[n++] = rdlen >> 8;
+        out[n++] = rdlen & 0xff;
+        out[n++] = 1;
+        memcpy(out + n, name, 15);
+        n += 15;
+        out[n++] = 0x00;                /* Workstation service */
+        out[n++] = 0x04; out[n++] = 0x00;   /* Active, unique */
+        memset(out + n, 0, 46);
+        memcpy(out + n, "\x02\x00\x00\x00\x00\x01", 6);
+        n += 46;
+    } else {
+        out[n++] = 0x00; out[n++] = 0x06;   /* RDLENGTH */
+        out[n++] = 0x00; out[n++] = 0x00;   /* NB flags */
+        memcpy(out + n, "\x7f\x00\x00\x01", 4);
+        n += 4;
+    }
+    return n;
+}
+
+/* Copy one header line ("Name: value\r\n") of a SIP request into out */
+static int copy_sip_header(const char *req, const char *name, char *out, int size) {
+    const char *p = strstr(req, name);
+    const char *end;
+
+    if (p == NULL || (end = strstr(p, "\r\n")) == NULL || end - p + 2 >= size)
+        return 0;
+    memcpy(out, p, end - p + 2);
+    return end - p + 2;
+}
+
+/* SIP: 200 OK to OPTIONS with the dialog headers echoed */
+static int reply_sip(const unsigned char *req, int len, unsigned char *out) {
+    char request[2048];
+    char *o = (char *)out;
+    int n;
+
+    if (len >= (int)sizeof(request))
+        return -1;
+    memcpy(request, req, len);
+    request[len] = '\0';
+
+    n = sprintf(o, "SIP/2.0 200 OK\r\n");
+    n += copy_sip_header(request, "Via:", o + n, 512);
+    n += copy_sip_header(request, "From:", o + n, 512);
+    n += copy_sip_header(request, "To:", o + n, 512);
+    n += copy_sip_header(request, "Call-ID:", o + n, 256);
+    n += copy_sip_header(request, "CSeq:", o + n, 256);
+    n += sprintf(o + n, "Allow: INVITE, ACK, CANCEL, OPTIONS, BYE\r\n"
+                        "Server: udp_responder\r\n"
+                        "Content-Length: 0\r\n\r\n");
+    return n;
+}
+
+/* SSDP: answer an M-SEARCH with one root device */
+static int reply_ssdp(unsigned char *out) {
+    return sprintf((char *)out,
+                   "HTTP/1.1 200 OK\r\n"
+                   "CACHE-CONTROL: max-age=1800\r\n"
+                   "EXT:\r\n"
+                   "LOCATION: http://127.0.0.1:49152/rootDesc.xml\r\n"
+                   "SERVER: Linux/6 UPnP/1.0 udp_responder/1.0\r\n"
+                   "ST: upnp:rootdevice\r\n"
+                   "USN: uuid:00000000-0000-0000-0000-000000000001::upnp:rootdevice\r\n"
+                   "\r\n");
+}
+
+/* Recognise the request by its payload */
+static service_t classify(const unsigned char *p, int len) {
+    if (len == 0)
+        return config.echo ? SVC_ECHO : SVC_NONE;
+    if (len >= 8 && memcmp(p, "OPTIONS ", 8) == 0)
+        return SVC_SIP;
+    if (len >= 8 && memcmp(p, "M-SEARCH", 8) == 0)
+        return SVC_SSDP;
+    if (len >= 240 && p[0] == 0x01 && memcmp(p + 236, "\x63\x82\x53\x63", 4) == 0)
+        return SVC_DHCP;
+    if (len >= 48 && (p[0] & 0x07) == 0x03)
+        return SVC_NTP;
+    if (len >= 14 && p[0] == 0x30)
+        return SVC_SNMP;
+    if (len >= 12 && !(p[2] & 0x80) && p[4] == 0 && p[5] >= 1) {
+        /* NetBIOS names are 32 encoded bytes; DNS labels are short */
+        if (p[12] == 0x20)
+            return SVC_NETBIOS;
+        return SVC_DNS;
+    }
+    return config.echo ? SVC_ECHO : SVC_NONE;
+}
+
+/* Build the reply for a request; returns its length, or -1 to stay silent */
+static int build_reply(service_t svc, const unsigned char *req, int len,
+                       unsigned char *out, int size) {
+    switch (svc) {
+    case SVC_DNS:
+        return reply_dns(req, len, out, size);
+    case SVC_NTP:
+        return reply_ntp(req, len, out);
+    case SVC_SNMP:
+        return reply_snmp(req, len, out);
+    case SVC_DHCP:
+        return reply_dhcp(req, len, out);
+    case SVC_NETBIOS:
+        return reply_netbios(req, len, out, size);
+    case SVC_SIP:
+        return reply_sip(req, len, out);
+    case SVC_SSDP:
+        return reply_ssdp(out);
+    case SVC_ECHO:
+        memcpy(out, "udp_responder\n", 14);
+        return 14;
+    default:
+        return -1;
+    }
+}
+
+/* Bind one port and add it to the epoll set */
+static int bind_port(int epfd, int port) {
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = config.addr;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Warning: Cannot bind port %d: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Bind every port of a list like "53,100-200"; returns the count bound */
+static int bind_ports(int epfd, const char *list) {
+    const char *p = list;
+    int bound = 0;
+
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        if (end == p || lo < 1 || hi > 65535 || lo > hi || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Error: Invalid port list '%s'\n", list);
+            return -1;
+        }
+        for (long port = lo; port <= hi; port++)
+            bound += bind_port(epfd, port) >= 0;
+        p = *end ? end + 1 : end;
+    }
+    return bound;
+}
+
+/* Answer everything queued on one socket */
+static void serve_socket(int fd) {
+    unsigned char req[MAX_PACKET_SIZE];
+    unsigned char reply[REPLY_MAX];
+    struct sockaddr_in from;
+    socklen_t fromlen;
+
+    for (;;) {
+        ssize_t n;
+        service_t svc;
+        int rlen;
+
+        fromlen = sizeof(from);
+        n = recvfrom(fd, req, sizeof(req), 0, (struct sockaddr *)&from, &fromlen);
+        if (n < 0)
+            return;
+        stats.requests++;
+
+        if (config.drop > 0 && rng_uniform() < config.drop) {
+            stats.dropped++;
+            continue;
+        }
+
+        svc = classify(req, n);
+        rlen = build_reply(svc, req, n, reply, sizeof(reply));
+        if (rlen < 0)
+            continue;
+        if (sendto(fd, reply, rlen, 0, (struct sockaddr *)&from, fromlen) == rlen)
+            stats.replies[svc]++;
+        if (config.verbose)
+            fprintf(stderr, "%s:%d -> %s reply (%d bytes)\n", inet_ntoa(from.sin_addr),
+                    ntohs(from.sin_port), service_names[svc], rlen);
+    }
+}
+
+/* Print usage */
+void print_usage(const char *prog_name) {
+    printf("Simulated UDP services for scanner benchmarks\n");
+    printf("Usage: %s [options]\n", prog_name);
+    printf("\nOptions:\n");
+    printf("  -a <addr>      Address to bind (default 127.0.0.1)\n");
+    printf("  -p <ports>     Ports to bind, e.g. 53,100-2000 (default: probe table ports)\n");
+    printf("  -d <fraction>  Drop this fraction of requests (0.0-1.0)\n");
+    printf("  -s <seed>      Seed for drop decisions (default 1)\n");
+    printf("  -e             Also answer empty and unrecognised payloads\n");
+    printf("  -v             Log every reply to stderr\n");
+    printf("\nUnbound ports are closed: the kernel answers ICMP port unreachable.\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct epoll_event events[EPOLL_BATCH];
+    struct rlimit rl;
+    uint64_t seed = 1;
+    int epfd, bound;
+    int opt;
+
+    inet_aton("127.0.0.1", &config.addr);
+
+    while ((opt = getopt(argc, argv, "a:p:d:s:evh")) != -1) {
+        switch (opt) {
+        case 'a':
+            if (inet_aton(optarg, &config.addr) == 0) {
+                fprintf(stderr, "Error: Invalid address '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            config.ports = optarg;
+            break;
+        case 'd':
+            config.drop = atof(optarg);
+            if (config.drop < 0 || config.drop > 1) {
+                fprintf(stderr, "Error: Drop fraction must be within 0-1\n");
+                return 1;
+            }
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'e':
+            config.echo = 1;
+            break;
+        case 'v':
+            config.verbose = 1;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    rng_state = seed ? seed : 1;
+
+    /* One socket per port: lift the descriptor limit as far as allowed */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    bound = bind_ports(epfd, config.ports);
+    if (bound <= 0) {
+        fprintf(stderr, "Error: No ports bound\n");
+        return 1;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    printf("udp_responder: %d ports bound on %s, drop %.3f, seed %llu\n",
+           bound, inet_ntoa(config.addr), config.drop, (unsigned long long)seed);
+    fflush(stdout);
+
+    while (!stopping) {
+        int n = epoll_wait(epfd, events, EPOLL_BATCH, -1);
+
+        for (int i = 0; i < n; i++)
+            serve_socket(events[i].data.fd);
+    }
+
+    printf("\n=== Responder Statistics ===\n");
+    printf("Requests: %lu\n", stats.requests);
+    printf("Dropped: %lu\n", stats.dropped);
+    for (int s = SVC_DNS; s < SVC_COUNT; s++) {
+        if (stats.replies[s] > 0)
+            printf("%s replies: %lu\n", service_names[s], stats.replies[s]);
+    }
+    return 0;
+}
@@ -0,0 +1,329 @@
+/*
+ * Binary Result Log Converter
+ * Author: Mikkel Andersen
+ * License: MIT
+ *
+ * Converts logs written by `udp_scanner --binary` to text, JSON Lines or
+ * CSV. The log is mmap'd and walked record by record, so conversion runs
+ * offline at disk speed regardless of log size. Flight recorder dumps and
+ * port state stores are recognised by their magic and decoded the same way.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "scan_record.h"
+
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_CSV
+} output_format_t;
+
+/* Print usage */
+void print_usage(const char *prog_name) {
+    printf("Convert udp_scanner binary result logs\n");
+    printf("Usage: %s [-f text|json|csv] <log_file>\n", prog_name);
+    printf("\nExamples:\n");
+    printf("  %s scan.bin                   # Human-readable text\n", prog_name);
+    printf("  %s -f json scan.bin > s.jsonl # JSON Lines\n", prog_name);
+    printf("  %s -f csv scan.bin > s.csv    # CSV with header row\n", prog_name);
+    printf("  %s udp_scanner-1234.flight    # Flight recorder dump\n", prog_name);
+    printf("  %s scan.state                 # Port state store: counts, open ports\n", prog_name);
+}
+
+/* Clock the record's RTT was measured with, as the scanner's JSON names it */
+static const char *rtt_source(const scan_log_record_t *rec) {
+    if (rec->flags & SCAN_REC_RTT_HW)
+        return "hardware";
+    if (rec->flags & SCAN_REC_RTT_KERNEL)
+        return "kernel";
+    return "user";
+}
+
+/* Print one record in the requested format */
+void print_record(const scan_log_record_t *rec, const scan_log_probe_t *probes,
+                  unsigned probe_count, output_format_t format) {
+    char addr[INET_ADDRSTRLEN];
+    char service[sizeof(probes[0].service) + 1] = "";
+    char probe[sizeof(probes[0].probe) + 1] = "";
+    struct in_addr in;
+
+    in.s_addr = rec->addr;
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+    if (rec->probe_id < probe_count) {
+        memcpy(service, probes[rec->probe_id].service, sizeof(probes[0].service));
+        memcpy(probe, probes[rec->probe_id].probe, sizeof(probes[0].probe));
+    }
+
+    switch (format) {
+    case FORMAT_TEXT:
+        printf("%u [%s] %s port %u/udp %s", rec->time, scan_state_name(rec->state),
+               addr, rec->port, service[0] ? service : "unknown");
+        if (rec->flags & SCAN_REC_UDP_REPLY)
+            printf(" %u bytes", rec->bytes);
+        if (rec->flags & SCAN_REC_ICMP)
+            printf(" icmp %u/%u", rec->icmp_type, rec->icmp_code);
+        if (rec->flags & SCAN_REC_RTT)
+            printf(" rtt %u us (%s)", rec->rtt_usec, rtt_source(rec));
+        printf("\n");
+        break;
+
+    case FORMAT_JSON:
+        printf("{\"time\":%u,\"target\":\"%s\",\"port\":%u,\"state\":\"%s\",",
+               rec->time, addr, rec->port, scan_state_name(rec->state));
+        if (service[0])
+            printf("\"service\":\"%s\",", service);
+        else
+            printf("\"service\":null,");
+        printf("\"probe\":\"%s\",", probe);
+        if (rec->flags & SCAN_REC_RTT)
+            printf("\"rtt_us\":%u,\"rtt_source\":\"%s\",", rec->rtt_usec, rtt_source(rec));
+        else
+            printf("\"rtt_us\":null,\"rtt_source\":null,");
+        printf("\"bytes\":%u,", rec->bytes);
+        if (rec->flags & SCAN_REC_ICMP)
+            printf("\"icmp_type\":%u,\"icmp_code\":%u,", rec->icmp_type, rec->icmp_code);
+        else
+            printf("\"icmp_type\":null,\"icmp_code\":null,");
+        /* Records keep no payload, so there is never a banner */
+        printf("\"banner\":null}\n");
+        break;
+
+    case FORMAT_CSV:
+        printf("%u,%s,%u,%s,%s,%s,", rec->time, addr, rec->port,
+               scan_state_name(rec->state), service, probe);
+        if (rec->flags & SCAN_REC_RTT)
+            printf("%u", rec->rtt_usec);
+        printf(",%u,", rec->bytes);
+        if (rec->flags & SCAN_REC_ICMP)
+            printf("%u,%u", rec->icmp_type, rec->icmp_code);
+        else
+            printf(",");
+        printf(",\n");
+        break;
+    }
+}
+
+/* Print one flight recorder event; `ns` is its wall time */
+void print_flight_event(const scan_flight_event_t *ev, uint32_t tid, uint64_t ns,
+                        output_format_t format) {
+    char addr[INET_ADDRSTRLEN];
+    char aux[24];
+    struct in_addr in;
+
+    in.s_addr = ev->addr;
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+    if (ev->type == SCAN_EV_RESULT)
+        snprintf(aux, sizeof(aux), "%s", scan_state_name(ev->aux));
+    else
+        snprintf(aux, sizeof(aux), "%u", ev->aux);
+
+    switch (format) {
+    case FORMAT_TEXT:
+        printf("%llu.%09llu tid %u %-10s %s:%u probe %u aux %s arg %lld\n",
+               (unsigned long long)(ns / 1000000000ULL), (unsigned long long)(ns % 1000000000ULL),
+               tid, scan_flight_event_name(ev->type), addr, ev->port, ev->probe_id,
+               aux, (long long)ev->arg);
+        break;
+    case FORMAT_JSON:
+        printf("{\"time_ns\":%llu,\"tid\":%u,\"event\":\"%s\",\"target\":\"%s\","
+               "\"port\":%u,\"probe_id\":%u,\"aux\":\"%s\",\"arg\":%lld}\n",
+               (unsigned long long)ns, tid, scan_flight_event_name(ev->type), addr,
+               ev->port, ev->probe_id, aux, (long long)ev->arg);
+        break;
+    case FORMAT_CSV:
+        printf("%llu,%u,%s,%s,%u,%u,%s,%lld\n", (unsigned long long)ns, tid,
+               scan_flight_event_name(ev->type), addr, ev->port, ev->probe_id,
+               aux, (long long)ev->arg);
+        break;
+    }
+}
+
+/* Decode a flight recorder dump: every thread's events, oldest first */
+int print_flight(const unsigned char *map, size_t size, output_format_t format) {
+    const scan_flight_header_t *h = (const scan_flight_header_t *)map;
+    size_t off = sizeof(*h);
+
+    if (size < sizeof(*h) || h->byte_order != SCAN_LOG_BYTE_ORDER ||
+        h->version != SCAN_FLIGHT_VERSION || h->event_size != sizeof(scan_flight_event_t) ||
+        h->clock_hz == 0)
+        return -1;
+
+    if (format == FORMAT_TEXT)
+        printf("# Flight recorder dump on signal %u, %u threads\n", h->signal, h->threads);
+    else if (format == FORMAT_CSV)
+        printf("time_ns,tid,event,target,port,probe_id,aux,arg\n");
+
+    for (uint32_t t = 0; t < h->threads; t++) {
+        const scan_flight_thread_t *th = (const scan_flight_thread_t *)(map + off);
+        const scan_flight_event_t *events;
+
+        if (off + sizeof(*th) > size)
+            return -1;
+        off += sizeof(*th);
+        if (off + (size_t)th->events * sizeof(*events) > size)
+            return -1;
+        events = (const scan_flight_event_t *)(map + off);
+        off += (size_t)th->events * sizeof(*events);
+
+        if (format == FORMAT_TEXT)
+            printf("# tid %u: last %u of %llu events\n", th->tid, th->events,
+                   (unsigned long long)th->recorded);
+        for (uint32_t i = 0; i < th->events; i++) {
+            /* Events are older than the dump by (clock_now - clock) ticks */
+            double ago = (double)(int64_t)(h->clock_now - events[i].clock) * 1e9 / h->clock_hz;
+
+            print_flight_event(&events[i], th->tid, h->realtime_ns - (int64_t)ago, format);
+        }
+    }
+    return 0;
+}
+
+/* Decode a port state store: per-slot counts, then the open port records */
+int print_state(const unsigned char *map, size_t size, output_format_t format) {
+    const scan_state_header_t *h = (const scan_state_header_t *)map;
+    const scan_log_probe_t *probes;
+    const scan_log_record_t *open;
+    uint64_t slots[4] = { 0, 0, 0, 0 };
+    char first[INET_ADDRSTRLEN];
+
+    if (scan_state_check_header(h, size) != NULL)
+        return -1;
+
+    if (format == FORMAT_TEXT) {
+        const uint8_t *bitmap = map + SCAN_STATE_BITMAP_OFFSET;
+
+        for (size_t i = 0; i < (size_t)h->hosts * SCAN_STATE_HOST_BYTES; i++) {
+            for (unsigned shift = 0; shift < 8; shift += 2)
+                slots[bitmap[i] >> shift & 3]++;
+        }
+        inet_ntop(AF_INET, &h->first_addr, first, sizeof(first));
+        printf("# Port state store: %u hosts from %s\n", h->hosts, first);
+        printf("#");
+        for (unsigned slot = 0; slot < 4; slot++)
+            printf(" %s %llu%s", scan_slot_name(slot), (unsigned long long)slots[slot],
+                   slot < 3 ? "," : "\n");
+    } else if (format == FORMAT_CSV) {
+        printf("time,target,port,state,service,probe,rtt_us,bytes,icmp_type,icmp_code,banner\n");
+    }
+
+    probes = (const scan_log_probe_t *)(map + sizeof(*h));
+    open = (const scan_log_record_t *)(map + scan_state_open_offset(h->hosts));
+    for (uint32_t i = 0; i < h->open_count; i++)
+        print_record(&open[i], probes, h->probe_count, format);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    output_format_t format = FORMAT_TEXT;
+    const scan_log_header_t *h;
+    const scan_log_probe_t *probes;
+    const scan_log_record_t *records;
+    const char *reason;
+    unsigned char *map;
+    struct stat st;
+    size_t count;
+    int fd;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (strcmp(optarg, "text") == 0) {
+                format = FORMAT_TEXT;
+            } else if (strcmp(optarg, "json") == 0) {
+                format = FORMAT_JSON;
+            } else if (strcmp(optarg, "csv") == 0) {
+                format = FORMAT_CSV;
+            } else {
+                fprintf(stderr, "Error: Unknown format '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    if ((size_t)st.st_size < sizeof(scan_log_header_t)) {
+        fprintf(stderr, "Error: %s: not a scan log\n", argv[optind]);
+        close(fd);
+        return 1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    if ((size_t)st.st_size >= sizeof(scan_flight_header_t) &&
+        memcmp(map, SCAN_FLIGHT_MAGIC, 8) == 0) {
+        int ret = print_flight(map, st.st_size, format);
+
+        if (ret < 0)
+            fprintf(stderr, "Error: %s: truncated or unsupported flight recorder dump\n",
+                    argv[optind]);
+        munmap(map, st.st_size);
+        return ret < 0 ? 1 : 0;
+    }
+
+    if (memcmp(map, SCAN_STATE_MAGIC, 8) == 0) {
+        int ret = print_state(map, st.st_size, format);
+
+        if (ret < 0)
+            fprintf(stderr, "Error: %s: %s\n", argv[optind],
+                    scan_state_check_header((const scan_state_header_t *)map, st.st_size));
+        munmap(map, st.st_size);
+        return ret < 0 ? 1 : 0;
+    }
+
+    h = (const scan_log_header_t *)map;
+    reason = scan_log_check_header(h, st.st_size);
+    if (reason != NULL) {
+        fprintf(stderr, "Error: %s: %s\n", argv[optind], reason);
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    probes = (const scan_log_probe_t *)(map + sizeof(*h));
+    records = (const scan_log_record_t *)(map + h->header_size);
+    count = (st.st_size - h->header_size) / sizeof(scan_log_record_t);
+
+    if (format == FORMAT_CSV)
+        printf("time,target,port,state,service,probe,rtt_us,bytes,icmp_type,icmp_code,banner\n");
+
+    for (size_t i = 0; i < count; i++)
+        print_record(&records[i], probes, h->probe_count, format);
+
+    munmap(map, st.st_size);
+    return 0;
+}
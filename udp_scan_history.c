@@ -0,0 +1,364 @@
+/*
+ * Scan History Query Tool
+ * Author: Mikkel Andersen
+ * License: MIT
+ *
+ * Answers questions about a store written by `udp_scanner --history <dir>`:
+ * which scans exist, how one address:port changed over time (and when it
+ * first appeared open), and what changed between two scans. Segments are
+ * sorted by (address, port), so lookups are binary searches over mmap'd
+ * files and diffs are a single merge pass.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "scan_record.h"
+
+/* One committed scan and its mapped segment */
+typedef struct {
+    scan_history_entry_t entry;
+    unsigned char *map;
+    size_t map_size;
+    const scan_log_probe_t *probes;
+    unsigned probe_count;
+    const scan_log_record_t *records;
+    size_t count;
+} segment_t;
+
+static const char *store_dir;
+
+/* Print usage */
+void print_usage(const char *prog_name) {
+    printf("Query a udp_scanner scan history store\n");
+    printf("Usage: %s <store> list\n", prog_name);
+    printf("       %s <store> history <address> <port>\n", prog_name);
+    printf("       %s <store> diff <scan_id> <scan_id>\n", prog_name);
+    printf("\nExamples:\n");
+    printf("  %s /var/lib/udpscan list\n", prog_name);
+    printf("  %s /var/lib/udpscan history 10.2.3.4 161   # When did it first open?\n", prog_name);
+    printf("  %s /var/lib/udpscan diff 41 42              # Changes between two scans\n", prog_name);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    uint32_t ia = ((const scan_history_entry_t *)a)->scan_id;
+    uint32_t ib = ((const scan_history_entry_t *)b)->scan_id;
+
+    return (ia > ib) - (ia < ib);
+}
+
+/* Load the manifest, ordered by scan id */
+segment_t *load_manifest(size_t *count) {
+    char path[PATH_MAX];
+    scan_history_manifest_t m;
+    scan_history_entry_t *entries;
+    segment_t *segments;
+    struct stat st;
+    size_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", store_dir, SCAN_HISTORY_MANIFEST);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (read(fd, &m, sizeof(m)) != sizeof(m) ||
+        memcmp(m.magic, SCAN_HISTORY_MAGIC, sizeof(m.magic)) != 0 ||
+        m.version != SCAN_HISTORY_VERSION || m.entry_size != sizeof(scan_history_entry_t)) {
+        fprintf(stderr, "Error: %s is not a scan history manifest\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    n = (st.st_size - sizeof(m)) / sizeof(scan_history_entry_t);
+    entries = malloc((n ? n : 1) * sizeof(*entries));
+    segments = calloc(n ? n : 1, sizeof(*segments));
+    if (entries == NULL || segments == NULL ||
+        read(fd, entries, n * sizeof(*entries)) != (ssize_t)(n * sizeof(*entries))) {
+        fprintf(stderr, "Error: Cannot read %s\n", path);
+        free(entries);
+        free(segments);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    qsort(entries, n, sizeof(*entries), compare_entries);
+    for (size_t i = 0; i < n; i++)
+        segments[i].entry = entries[i];
+    free(entries);
+
+    *count = n;
+    return segments;
+}
+
+/* Map a scan's segment on first use */
+int map_segment(segment_t *seg) {
+    char path[PATH_MAX];
+    const scan_log_header_t *h;
+    const char *reason;
+    struct stat st;
+    int fd;
+
+    if (seg->map != NULL)
+        return 0;
+
+    snprintf(path, sizeof(path), "%s/" SCAN_HISTORY_SEGMENT_FMT, store_dir, seg->entry.scan_id);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    seg->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (seg->map == MAP_FAILED) {
+        seg->map = NULL;
+        fprintf(stderr, "Error: Cannot map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    seg->map_size = st.st_size;
+
+    h = (const scan_log_header_t *)seg->map;
+    reason = scan_log_check_header(h, st.st_size);
+    if (reason != NULL) {
+        fprintf(stderr, "Error: %s: %s\n", path, reason);
+        munmap(seg->map, seg->map_size);
+        seg->map = NULL;
+        return -1;
+    }
+
+    seg->probes = (const scan_log_probe_t *)(seg->map + sizeof(*h));
+    seg->probe_count = h->probe_count;
+    seg->records = (const scan_log_record_t *)(seg->map + h->header_size);
+    seg->count = (st.st_size - h->header_size) / sizeof(scan_log_record_t);
+    return 0;
+}
+
+/* Binary search a sorted segment for one (address, port) */
+const scan_log_record_t *find_record(const segment_t *seg, uint64_t key) {
+    size_t lo = 0, hi = seg->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        uint64_t k = scan_record_key(&seg->records[mid]);
+
+        if (k == key)
+            return &seg->records[mid];
+        if (k < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+void format_time(uint64_t t, char *out, size_t size) {
+    time_t tt = (time_t)t;
+    struct tm tm;
+
+    localtime_r(&tt, &tm);
+    strftime(out, size, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+const char *record_service(const segment_t *seg, const scan_log_record_t *rec) {
+    static char service[sizeof(seg->probes[0].service) + 1];
+
+    service[0] = '\0';
+    if (rec->probe_id < seg->probe_count)
+        memcpy(service, seg->probes[rec->probe_id].service, sizeof(seg->probes[0].service));
+    return service[0] ? service : "unknown";
+}
+
+/* List committed scans */
+int cmd_list(segment_t *segments, size_t count) {
+    printf("%-8s %-19s  %-15s %-11s %s\n", "SCAN", "STARTED", "TARGET", "PORTS", "RECORDS");
+    for (size_t i = 0; i < count; i++) {
+        const scan_history_entry_t *e = &segments[i].entry;
+        char started[32], addr[INET_ADDRSTRLEN], ports[16];
+        struct in_addr in;
+
+        in.s_addr = e->target;
+        inet_ntop(AF_INET, &in, addr, sizeof(addr));
+        format_time(e->started, started, sizeof(started));
+        snprintf(ports, sizeof(ports), "%u-%u", e->start_port, e->end_port);
+        printf("%-8u %-19s  %-15s %-11s %llu\n", e->scan_id, started, addr, ports,
+               (unsigned long long)e->records);
+    }
+    return 0;
+}
+
+/* Show one address:port across every scan, oldest first */
+int cmd_history(segment_t *segments, size_t count, const char *addr_str, const char *port_str) {
+    scan_log_record_t probe;
+    struct in_addr addr;
+    const segment_t *first_open = NULL;
+    const segment_t *last_open = NULL;
+    int port = atoi(port_str);
+    uint64_t key;
+
+    if (inet_aton(addr_str, &addr) == 0 || port < 1 || port > 65535) {
+        fprintf(stderr, "Error: Invalid address or port\n");
+        return 1;
+    }
+    memset(&probe, 0, sizeof(probe));
+    probe.addr = addr.s_addr;
+    probe.port = port;
+    key = scan_record_key(&probe);
+
+    for (size_t i = 0; i < count; i++) {
+        segment_t *seg = &segments[i];
+        const scan_log_record_t *rec;
+        char when[32];
+
+        if (map_segment(seg) < 0)
+            return 1;
+
+        rec = find_record(seg, key);
+        if (rec == NULL)
+            continue;
+
+        format_time(rec->time, when, sizeof(when));
+        printf("scan %-6u %s  %-14s %s", seg->entry.scan_id, when,
+               scan_state_name(rec->state), record_service(seg, rec));
+        if (rec->flags & SCAN_REC_UDP_REPLY)
+            printf(" %u bytes", rec->bytes);
+        if (rec->flags & SCAN_REC_ICMP)
+            printf(" icmp %u/%u", rec->icmp_type, rec->icmp_code);
+        if (rec->flags & SCAN_REC_RTT)
+            printf(" rtt %u us", rec->rtt_usec);
+        printf("\n");
+
+        if (rec->state == SCAN_STATE_OPEN) {
+            if (first_open == NULL)
+                first_open = seg;
+            last_open = seg;
+        }
+    }
+
+    if (first_open != NULL) {
+        char when[32];
+
+        format_time(first_open->entry.started, when, sizeof(when));
+        printf("\n%s:%d first seen open in scan %u (%s)", addr_str, port,
+               first_open->entry.scan_id, when);
+        format_time(last_open->entry.started, when, sizeof(when));
+        printf(", last in scan %u (%s)\n", last_open->entry.scan_id, when);
+    } else {
+        printf("\n%s:%d never seen open\n", addr_str, port);
+    }
+    return 0;
+}
+
+segment_t *find_segment(segment_t *segments, size_t count, const char *id_str) {
+    uint32_t id = (uint32_t)strtoul(id_str, NULL, 10);
+
+    for (size_t i = 0; i < count; i++) {
+        if (segments[i].entry.scan_id == id)
+            return &segments[i];
+    }
+    fprintf(stderr, "Error: No scan %s in %s\n", id_str, store_dir);
+    return NULL;
+}
+
+void print_change(char mark, const scan_log_record_t *rec, const char *from, const char *to) {
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in;
+
+    in.s_addr = rec->addr;
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+    printf("%c %s:%u/udp %s -> %s\n", mark, addr, rec->port, from, to);
+}
+
+/* Merge-join two sorted segments and print every port whose state differs */
+int cmd_diff(segment_t *segments, size_t count, const char *a_str, const char *b_str) {
+    segment_t *a = find_segment(segments, count, a_str);
+    segment_t *b = find_segment(segments, count, b_str);
+    size_t i = 0, j = 0;
+    size_t added = 0, removed = 0, changed = 0;
+
+    if (a == NULL || b == NULL || map_segment(a) < 0 || map_segment(b) < 0)
+        return 1;
+
+    while (i < a->count || j < b->count) {
+        uint64_t ka = i < a->count ? scan_record_key(&a->records[i]) : UINT64_MAX;
+        uint64_t kb = j < b->count ? scan_record_key(&b->records[j]) : UINT64_MAX;
+
+        if (ka < kb) {
+            print_change('-', &a->records[i], scan_state_name(a->records[i].state), "not scanned");
+            removed++;
+            i++;
+        } else if (kb < ka) {
+            print_change('+', &b->records[j], "not scanned", scan_state_name(b->records[j].state));
+            added++;
+            j++;
+        } else {
+            if (a->records[i].state != b->records[j].state) {
+                print_change('~', &b->records[j], scan_state_name(a->records[i].state),
+                             scan_state_name(b->records[j].state));
+                changed++;
+            }
+            i++;
+            j++;
+        }
+    }
+
+    printf("\n%zu changed, %zu only in scan %u, %zu only in scan %u\n",
+           changed, removed, a->entry.scan_id, added, b->entry.scan_id);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    segment_t *segments;
+    const char *cmd;
+    size_t count = 0;
+    int ret;
+
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    store_dir = argv[1];
+    cmd = argv[2];
+    if (!(strcmp(cmd, "list") == 0 && argc == 3) &&
+        !(strcmp(cmd, "history") == 0 && argc == 5) &&
+        !(strcmp(cmd, "diff") == 0 && argc == 5)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    segments = load_manifest(&count);
+    if (segments == NULL)
+        return 1;
+
+    if (strcmp(cmd, "list") == 0)
+        ret = cmd_list(segments, count);
+    else if (strcmp(cmd, "history") == 0)
+        ret = cmd_history(segments, count, argv[3], argv[4]);
+    else
+        ret = cmd_diff(segments, count, argv[3], argv[4]);
+
+    for (size_t i = 0; i < count; i++) {
+        if (segments[i].map != NULL)
+            munmap(segments[i].map, segments[i].map_size);
+    }
+    free(segments);
+    return ret;
+}
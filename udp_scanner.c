@@ -9,8 +9,23 @@
  * - Multi-threaded scanning
  * - RFC-compliant probe generation
  * - Service fingerprinting for common UDP services
+ * - Pluggable output sinks (text, JSON Lines, CSV, XML, binary log) written
+ *   by asynchronous writer threads
+ * - Result streaming to a Unix socket or FIFO behind a bounded queue
+ * - gzip compression of text-like outputs on the writer threads (zlib)
+ * - Append-only scan history store (see scan_record.h, udp_scan_history)
+ * - Incremental re-scans against a previous binary log or history store
+ * - Live progress on stderr sampled from per-thread counters
+ * - Per-service response latency histograms reported as percentiles
+ * - Prometheus metrics endpoint on localhost
+ * - RTT from SO_TIMESTAMPING kernel/NIC timestamps, driving an adaptive
+ *   per-host probe timeout
+ * - pcap capture of scan traffic and offline replay of captures
+ * - Flight recorder of recent engine events, dumped on SIGUSR1 or a crash
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,13 +41,128 @@
 #include <netdb.h>
 #include <signal.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * USDT tracepoints, provider "udp_scanner". Each carries the target
+ * (IPv4, network byte order), port, probe id and one event argument:
+ *
+ *   probe__sent     attempt number (0 for the first send)
+ *   retry           attempt number about to be sent
+ *   udp__response   RTT in microseconds
+ *   icmp__error     ICMP unreachable code
+ *   timeout         timeout of the attempt in microseconds
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev) each is a nop plus an ELF note that
+ * bpftrace and perf can attach to; without it they compile to nothing.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define SCAN_TRACE(event, target, port, probe_id, arg) \
+    STAP_PROBE4(udp_scanner, event, target, port, probe_id, arg)
+#else
+#define SCAN_TRACE(event, target, port, probe_id, arg) do { } while (0)
+#endif
+
+#include "scan_record.h"
 
-#define MAX_PACKET_SIZE 65536
 #define TIMEOUT_SEC 2
 #define TIMEOUT_USEC 0
 #define MAX_RETRIES 2
 #define MAX_THREADS 10
 
+#define FAST_TIMEOUT_MIN_USEC 100000  /* Floor of the fast re-probe timeout */
+#define FAST_TIMEOUT_RTT_FACTOR 4      /* Fast re-probe waits this many baseline RTTs */
+#define BASELINE_MAX_AGE_HOURS 24      /* Default age up to which baseline CLOSED is trusted */
+
+#define HOST_TIMEOUT_MIN_USEC 100000   /* Floor of the RTT-derived probe timeout */
+
+#define METRICS_POLL_MS 250              /* How often the metrics thread checks for shutdown */
+
+/* Long options without a short form */
+enum {
+    OPT_STREAM_FORMAT = 256,
+    OPT_STREAM_POLICY,
+    OPT_STREAM_QUEUE,
+    OPT_FLIGHT,
+    OPT_STATE
+};
+
+#define PROGRESS_INTERVAL_SEC 1         /* Default seconds between progress lines */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Latency histograms are log-linear (HDR style): each power of two of
+ * microseconds is split into LAT_SUB_BUCKETS linear buckets, so every
+ * recorded value keeps about 3% precision from 1 us up to 2^32 us
+ * (about 71 minutes).
+ */
+#define LAT_SUB_BITS 5
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_MAX_SHIFT 26
+#define LAT_BUCKETS ((LAT_MAX_SHIFT + 2) << LAT_SUB_BITS)
+
+#define OUTPUT_CHUNK_SIZE (256 * 1024)  /* Bytes per output buffer handed to the writer */
+#define OUTPUT_POOL_CHUNKS 8            /* Free buffers the writer keeps for reuse */
+#define OUTPUT_RECORD_MAX 512           /* Upper bound of one formatted record */
+#define OUTPUT_GZIP_LEVEL 6             /* zlib level for outputs named *.gz */
+#define STREAM_CHUNK_SIZE 4096          /* Stream buffers carry one record each */
+#define STREAM_QUEUE_RECORDS 1024       /* Default records queued for a slow consumer */
+
+#define PCAP_RING_SIZE (4u << 20)       /* Capture ring bytes per scanning thread */
+#define PCAP_DRAIN_NSEC 2000000         /* Capture writer's nap when every ring is empty */
+#define PCAP_SNAPLEN 65535
+#define PCAP_LINKTYPE_RAW 101           /* Packets start at the IPv4 header */
+#define PCAP_PAD UINT32_MAX             /* incl_len of a ring slot that skips to the start */
+
+#define FLIGHT_EVENTS 4096              /* Events kept per scanning thread (power of two) */
+
+#define RX_BUF_SIZE 2048                /* Receive slot: a 1500-byte MTU packet, cache-line multiple */
+#define RX_POOL_BUFFERS 16              /* Receive slots per scanning thread (power of two) */
+
+#define ARENA_BLOCK_SIZE (64 * 1024)    /* Bytes per result arena block */
+#define BANNER_MAX 64                   /* Reply bytes kept as a result's banner */
+
+#define HUGE_PAGE_SIZE (2u << 20)       /* x86-64 and arm64 default huge page */
+#define MAX_ENGINE_TABLES 16
+
+#define PROBE_INTERVAL_USEC 10000       /* Pause between ports, which sets the probe rate */
+#define INFLIGHT_MIN_SLOTS 64           /* Smallest in-flight table (power of two) */
+
+/* Final port states; values double as receive_response() return codes */
+typedef enum {
+    PORT_OPEN = SCAN_STATE_OPEN,
+    PORT_OPEN_FILTERED = SCAN_STATE_OPEN_FILTERED,
+    PORT_CLOSED = SCAN_STATE_CLOSED,
+    PORT_FILTERED = SCAN_STATE_FILTERED
+} port_state_t;
+
 /* Service detection payloads based on RFCs */
 typedef struct {
     int port;
@@ -40,6 +170,7 @@ typedef struct {
     const unsigned char *payload;
     size_t payload_len;
     const char *expected_response;
+    const char *probe_name;
 } udp_probe_t;
 
 /* Common UDP service probes */
@@ -66,7 +197,8 @@ static const unsigned char ntp_probe[] = {
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00  // Transmit timestamp (48 bytes total)
 };
 
 /* SNMP probe - RFC 1157 */
@@ -141,10 +273,11 @@ static const unsigned char netbios_probe[] = {
     0x00, 0x00, // Answer RRs
     0x00, 0x00, // Authority RRs
     0x00, 0x00, // Additional RRs
-    0x20, 0x43, 0x4b, 0x41, 0x41, 0x41, 0x41, 0x41, // Encoded name
+    0x20, 0x43, 0x4b, 0x41, 0x41, 0x41, 0x41, 0x41, // Encoded name "*" (32 bytes)
     0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41,
     0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41,
     0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41,
+    0x41,
     0x00,
     0x00, 0x21, // Type: NB
     0x00, 0x01  // Class: IN
@@ -167,283 +300,4475 @@ static const unsigned char empty_probe[] = "";
 
 /* Protocol database */
 static udp_probe_t udp_probes[] = {
-    {53,    "DNS",       dns_probe,     sizeof(dns_probe),     "DNS response"},
-    {123,   "NTP",       ntp_probe,     sizeof(ntp_probe),     "NTP response"},
-    {161,   "SNMP",      snmp_probe,    sizeof(snmp_probe),    "SNMP response"},
-    {67,    "DHCP",      dhcp_probe,    sizeof(dhcp_probe),    "DHCP response"},
-    {68,    "DHCP",      dhcp_probe,    sizeof(dhcp_probe),    "DHCP response"},
-    {137,   "NetBIOS",   netbios_probe, sizeof(netbios_probe), "NetBIOS response"},
-    {138,   "NetBIOS",   netbios_probe, sizeof(netbios_probe), "NetBIOS response"},
-    {5060,  "SIP",       (const unsigned char*)sip_probe, strlen(sip_probe), "SIP response"},
-    {69,    "TFTP",      empty_probe,   0,                     "TFTP response"},
-    {514,   "Syslog",    empty_probe,   0,                     "Syslog response"},
-    {520,   "RIP",       empty_probe,   0,                     "RIP response"},
-    {1900,  "SSDP",      empty_probe,   0,                     "SSDP response"},
-    {0,     NULL,        NULL,          0,                     NULL}
+    {53,    "DNS",       dns_probe,     sizeof(dns_probe),     "DNS response",     "dns-version-bind"},
+    {123,   "NTP",       ntp_probe,     sizeof(ntp_probe),     "NTP response",     "ntp-client"},
+    {161,   "SNMP",      snmp_probe,    sizeof(snmp_probe),    "SNMP response",    "snmp-get-public"},
+    {67,    "DHCP",      dhcp_probe,    sizeof(dhcp_probe),    "DHCP response",    "dhcp-discover"},
+    {68,    "DHCP",      dhcp_probe,    sizeof(dhcp_probe),    "DHCP response",    "dhcp-discover"},
+    {137,   "NetBIOS",   netbios_probe, sizeof(netbios_probe), "NetBIOS response", "netbios-name-query"},
+    {138,   "NetBIOS",   netbios_probe, sizeof(netbios_probe), "NetBIOS response", "netbios-name-query"},
+    {5060,  "SIP",       (const unsigned char*)sip_probe, strlen(sip_probe), "SIP response", "sip-options"},
+    {69,    "TFTP",      empty_probe,   0,                     "TFTP response",    "empty"},
+    {514,   "Syslog",    empty_probe,   0,                     "Syslog response",  "empty"},
+    {520,   "RIP",       empty_probe,   0,                     "RIP response",     "empty"},
+    {1900,  "SSDP",      empty_probe,   0,                     "SSDP response",    "empty"},
+    {0,     NULL,        NULL,          0,                     NULL,               NULL}
 };
 
+/* Probe id of the empty probe sent to ports without a table entry */
+#define PROBE_ID_GENERIC ((int)(sizeof(udp_probes) / sizeof(udp_probes[0])) - 1)
+
 /* Scan statistics */
 typedef struct {
     int total_ports;
     int open_ports;
     int closed_ports;
     int filtered_ports;
+    int skipped_ports;          /* Closed in the baseline and not probed again */
+    int resumed_ports;          /* Already in the port state store */
     struct timeval start_time;
     struct timeval end_time;
 } scan_stats_t;
 
 scan_stats_t stats = {0};
 
-/* Get protocol-specific probe for port */
-udp_probe_t* get_probe_for_port(int port) {
-    for (int i = 0; udp_probes[i].service_name != NULL; i++) {
-        if (udp_probes[i].port == port) {
-            return &udp_probes[i];
-        }
-    }
-    return NULL;
-}
+/* What a latency sample measured */
+typedef enum {
+    LAT_UDP_REPLY,              /* Probe sent to UDP response */
+    LAT_ICMP_ERROR,             /* Probe sent to ICMP unreachable */
+    LAT_KINDS
+} latency_kind_t;
 
-/* Calculate checksum for ICMP/IP */
-unsigned short checksum(void *b, int len) {
-    unsigned short *buf = b;
-    unsigned int sum = 0;
-    unsigned short result;
+static const char *const latency_kind_names[LAT_KINDS] = { "udp-reply", "icmp-unreach" };
 
-    for (sum = 0; len > 1; len -= 2)
-        sum += *buf++;
-    if (len == 1)
-        sum += *(unsigned char *)buf;
-    sum = (sum >> 16) + (sum & 0xFFFF);
-    sum += (sum >> 16);
-    result = ~sum;
-    return result;
-}
+/* Written by the owning thread only; readable at any time, like the counters */
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;               /* Microseconds */
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[LAT_BUCKETS];
+} latency_hist_t;
 
-/* Send UDP probe packet */
-int send_udp_probe(int sockfd, const char *target_ip, int port, 
-                   const unsigned char *payload, size_t payload_len) {
-    struct sockaddr_in dest;
-    int ret;
+/* One histogram per probe and response kind */
+typedef struct {
+    latency_hist_t hist[PROBE_ID_GENERIC + 1][LAT_KINDS];
+} latency_set_t;
 
-    memset(&dest, 0, sizeof(dest));
-    dest.sin_family = AF_INET;
-    dest.sin_port = htons(port);
-    dest.sin_addr.s_addr = inet_addr(target_ip);
+/* System calls made on the probe path */
+typedef enum {
+    SYSCALL_SENDTO,
+    SYSCALL_RECVMSG,                    /* UDP replies and ICMP errors */
+    SYSCALL_ERRQUEUE,                   /* TX timestamp reads, including the empty one */
+    SYSCALL_SELECT,
+    SYSCALL_SOCKET,                     /* socket(), setsockopt() and close() per port */
+    SYSCALL_KINDS
+} syscall_kind_t;
 
-    if (payload_len > 0) {
-        ret = sendto(sockfd, payload, payload_len, 0,
-                    (struct sockaddr *)&dest, sizeof(dest));
-    } else {
-        /* Send empty UDP packet */
-        ret = sendto(sockfd, "", 0, 0,
-                    (struct sockaddr *)&dest, sizeof(dest));
-    }
+static const char *const syscall_names[SYSCALL_KINDS] = {
+    "sendto", "recvmsg", "errqueue", "select", "socket"
+};
 
-    if (ret < 0) {
-        perror("sendto");
-        return -1;
-    }
+/* sendto() failures told apart in the summary */
+typedef enum {
+    SEND_ENOBUFS,                       /* Local queue or qdisc full */
+    SEND_EPERM,                         /* Blocked by the local firewall */
+    SEND_ECONNREFUSED,                  /* Earlier ICMP error reported on the socket */
+    SEND_OTHER,
+    SEND_ERRNO_KINDS
+} send_errno_t;
 
-    return 0;
-}
+static const char *const send_errno_names[SEND_ERRNO_KINDS] = {
+    "ENOBUFS", "EPERM", "ECONNREFUSED", "other"
+};
 
-/* Receive and analyze responses */
-int receive_response(int udp_sock, int icmp_sock, int port, char *service_name) {
-    unsigned char buffer[MAX_PACKET_SIZE];
-    struct sockaddr_in from;
-    socklen_t fromlen = sizeof(from);
-    fd_set readfds;
-    struct timeval tv;
-    int ret;
-    int maxfd;
+/*
+ * Flight recorder of one scanning thread: the last FLIGHT_EVENTS engine
+ * events, overwritten in a circle. Only the owner writes it; a signal
+ * handler may read it at any time, at worst catching one event half
+ * written.
+ */
+typedef struct {
+    _Atomic uint64_t recorded;
+    uint32_t tid;
+    scan_flight_event_t events[FLIGHT_EVENTS];
+} flight_ring_t;
 
-    FD_ZERO(&readfds);
-    FD_SET(udp_sock, &readfds);
-    FD_SET(icmp_sock, &readfds);
-    
-    maxfd = (udp_sock > icmp_sock) ? udp_sock : icmp_sock;
+/*
+ * Progress counters of one scanning thread. Only the owner writes them, with
+ * relaxed load/store pairs rather than read-modify-write instructions, and
+ * each block sits on its own cache line, so counting costs the hot path no
+ * lock and no shared-line traffic. The reporter sums all blocks.
+ */
+typedef struct scan_counters {
+    _Atomic uint64_t probes_sent;
+    _Atomic uint64_t responses;         /* UDP replies and ICMP errors */
+    _Atomic uint64_t in_flight;         /* Probes sent and still awaited */
+    _Atomic uint64_t ports_done;        /* Ports finished, including skipped */
+    _Atomic uint64_t results[4];        /* Final port states, by port_state_t */
+    _Atomic uint64_t icmp_unreach[16];  /* ICMP destination unreachable, by code */
+    _Atomic uint64_t send_errors;
+    _Atomic uint64_t send_errno[SEND_ERRNO_KINDS];
+    _Atomic uint64_t syscalls[SYSCALL_KINDS];
+    _Atomic uint64_t rxq_drops;         /* Datagrams lost to full receive queues */
+    _Atomic uint64_t rx_truncated;      /* Datagrams larger than a receive slot */
+    latency_set_t *latency;
+    flight_ring_t *flight;
+    struct scan_counters *next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) scan_counters_t;
 
-    tv.tv_sec = TIMEOUT_SEC;
-    tv.tv_usec = TIMEOUT_USEC;
+/* Sum of every thread's counters at one point in time */
+typedef struct {
+    uint64_t probes_sent;
+    uint64_t responses;
+    uint64_t in_flight;
+    uint64_t ports_done;
+    uint64_t results[4];
+    uint64_t icmp_unreach[16];
+    uint64_t send_errors;
+    uint64_t send_errno[SEND_ERRNO_KINDS];
+    uint64_t syscalls[SYSCALL_KINDS];
+    uint64_t rxq_drops;
+    uint64_t rx_truncated;
+} progress_sample_t;
 
-    ret = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+static scan_counters_t *counters_list = NULL;
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local scan_counters_t *thread_counters;
 
-    if (ret < 0) {
-        perror("select");
-        return -1;
-    } else if (ret == 0) {
-        /* Timeout - port is likely open|filtered */
-        printf("[OPEN|FILTERED] Port %d/udp %s (no response)\n", port, 
-               service_name ? service_name : "unknown");
-        stats.filtered_ports++;
-        return 1;
-    }
+/* Periodic progress reporter */
+typedef struct {
+    int interval;               /* Seconds between lines; 0 disables reporting */
+    int tty;                    /* Redraw one line instead of appending lines */
+    uint64_t total_ports;
+    struct timespec started;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stopping;
+} progress_reporter_t;
 
-    /* Check UDP socket for service response */
-    if (FD_ISSET(udp_sock, &readfds)) {
-        ssize_t n = recvfrom(udp_sock, buffer, sizeof(buffer), 0,
-                            (struct sockaddr *)&from, &fromlen);
-        if (n > 0) {
-            printf("[OPEN] Port %d/udp %s (service responded: %zd bytes)\n",
-                   port, service_name ? service_name : "unknown", n);
-            stats.open_ports++;
-            return 0;
-        }
-    }
+/* Kernel UDP counters from /proc/net/snmp (system wide) */
+typedef struct {
+    uint64_t in_datagrams;
+    uint64_t no_ports;
+    uint64_t in_errors;
+    uint64_t out_datagrams;
+    uint64_t rcvbuf_errors;
+    uint64_t sndbuf_errors;
+} udp_snmp_t;
 
-    /* Check ICMP socket for port unreachable */
-    if (FD_ISSET(icmp_sock, &readfds)) {
-        ssize_t n = recvfrom(icmp_sock, buffer, sizeof(buffer), 0,
-                            (struct sockaddr *)&from, &fromlen);
-        if (n > 0) {
-            struct ip *ip_hdr = (struct ip *)buffer;
-            struct icmp *icmp_hdr = (struct icmp *)(buffer + (ip_hdr->ip_hl << 2));
-
-            if (icmp_hdr->icmp_type == ICMP_UNREACH) {
-                if (icmp_hdr->icmp_code == ICMP_UNREACH_PORT) {
-                    printf("[CLOSED] Port %d/udp (ICMP port unreachable)\n", port);
-                    stats.closed_ports++;
-                    return 2;
-                } else {
-                    printf("[FILTERED] Port %d/udp (ICMP unreachable type %d, code %d)\n",
-                           port, icmp_hdr->icmp_type, icmp_hdr->icmp_code);
-                    stats.filtered_ports++;
-                    return 3;
-                }
-            }
-        }
-    }
+/* UDP MIB when probing started, for the kernel drops of the scan */
+static udp_snmp_t snmp_at_start;
+static int snmp_at_start_valid;
 
-    return -1;
-}
+/* Prometheus text endpoint served from its own thread */
+typedef struct {
+    int port;                   /* 0 disables the endpoint */
+    int listen_fd;
+    pthread_t thread;
+    atomic_int stopping;
+    uint64_t total_ports;
+    uint64_t last_sent;         /* Probes at the previous scrape, for the rate gauge */
+    struct timespec last_scrape;
+} metrics_server_t;
 
-/* Scan single UDP port */
-void scan_udp_port(const char *target_ip, int port) {
-    int udp_sock, icmp_sock;
-    udp_probe_t *probe;
-    const unsigned char *payload;
-    size_t payload_len;
-    char *service_name = NULL;
+static metrics_server_t metrics = { .listen_fd = -1 };
 
-    /* Create UDP socket */
-    udp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (udp_sock < 0) {
-        perror("UDP socket creation failed");
-        return;
-    }
+/* pcap record header as stored in the file, with nanosecond timestamps */
+typedef struct {
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_rec_t;
 
-    /* Create raw socket for ICMP */
-    icmp_sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-    if (icmp_sock < 0) {
-        perror("ICMP socket creation failed (need root)");
-        close(udp_sock);
-        return;
-    }
+/*
+ * Single-producer, single-consumer byte ring of pcap records. The scanning
+ * thread that owns the ring advances head, the capture writer advances
+ * tail. Records never wrap: a PCAP_PAD slot, or an end of ring too short
+ * to hold one, sends the reader back to the start. A full ring drops the
+ * packet rather than wait for the writer.
+ */
+typedef struct pcap_ring {
+    _Atomic size_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint64_t dropped;
+    _Atomic size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned char *data;
+    struct pcap_ring *next;
+} pcap_ring_t;
 
-    /* Get protocol-specific probe */
-    probe = get_probe_for_port(port);
-    if (probe) {
-        payload = probe->payload;
-        payload_len = probe->payload_len;
-        service_name = (char *)probe->service_name;
-    } else {
-        payload = empty_probe;
-        payload_len = 0;
-    }
+/* Packet capture (--pcap) drained by its own writer thread */
+typedef struct {
+    FILE *out;                  /* NULL while capture is off */
+    const char *path;
+    struct in_addr local_addr;  /* Our source address toward the target */
+    pcap_ring_t *rings;
+    pthread_mutex_t lock;       /* Guards ring registration */
+    pthread_t thread;
+    atomic_int stopping;
+    uint64_t written;
+} pcap_capture_t;
 
-    /* Send probe with retries */
-    for (int i = 0; i < MAX_RETRIES; i++) {
-        if (send_udp_probe(udp_sock, target_ip, port, payload, payload_len) < 0) {
-            close(udp_sock);
-            close(icmp_sock);
-            return;
-        }
+static pcap_capture_t capture = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
-        /* Wait for response */
-        int result = receive_response(udp_sock, icmp_sock, port, service_name);
-        
-        /* If we got definitive answer (open or closed), stop retrying */
-        if (result == 0 || result == 2) {
-            break;
-        }
-    }
+static _Thread_local pcap_ring_t *thread_ring;
+static _Thread_local uint16_t capture_local_port;  /* Source port of the current probe socket */
 
-    close(udp_sock);
-    close(icmp_sock);
-}
+/*
+ * Receive buffers of one scanning thread: RX_POOL_BUFFERS cache-aligned,
+ * MTU-sized slots handed out in turn, allocated once. Decoders work on a
+ * slot in place; it stays valid until the thread has taken
+ * RX_POOL_BUFFERS more. The count is sized for a future recvmmsg() batch;
+ * today each receive call takes one slot.
+ */
+typedef struct {
+    unsigned char slot[RX_POOL_BUFFERS][RX_BUF_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned next;
+} rx_pool_t;
 
-/* Print usage */
-void print_usage(const char *prog_name) {
-    printf("UDP Port Scanner with Protocol-Specific Probes\n");
-    printf("Usage: %s <target_ip> <start_port> <end_port>\n", prog_name);
-    printf("\nExamples:\n");
-    printf("  %s 192.168.1.1 1 1000          # Scan ports 1-1000\n", prog_name);
-    printf("  %s 10.0.0.1 53 53              # Scan DNS port\n", prog_name);
-    printf("  %s 192.168.1.1 1 65535         # Full port scan\n", prog_name);
-    printf("\nNote: Requires root/sudo for ICMP detection\n");
-}
+static _Thread_local rx_pool_t *thread_rx_pool;
 
-/* Print statistics */
-void print_statistics() {
-    double elapsed;
-    
-    gettimeofday(&stats.end_time, NULL);
-    elapsed = (stats.end_time.tv_sec - stats.start_time.tv_sec) +
-              (stats.end_time.tv_usec - stats.start_time.tv_usec) / 1000000.0;
+/*
+ * Bump allocator for what a scanning thread's results point to, such as
+ * banners. Results are formatted into the sinks' chunks before they are
+ * released, so everything is freed at once by rewinding to the first
+ * block; blocks are kept, and once the arena has grown to its working size
+ * no allocation reaches malloc.
+ */
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    unsigned char data[] __attribute__((aligned(16)));
+} arena_block_t;
 
-    printf("\n=== Scan Statistics ===\n");
-    printf("Total ports scanned: %d\n", stats.total_ports);
-    printf("Open ports: %d\n", stats.open_ports);
-    printf("Closed ports: %d\n", stats.closed_ports);
-    printf("Filtered/Open|Filtered: %d\n", stats.filtered_ports);
-    printf("Scan duration: %.2f seconds\n", elapsed);
-    printf("Scan rate: %.2f ports/sec\n", stats.total_ports / elapsed);
-}
+typedef struct {
+    arena_block_t *first;
+    arena_block_t *cur;
+} arena_t;
 
-int main(int argc, char *argv[]) {
-    char *target_ip;
-    int start_port, end_port;
+static _Thread_local arena_t thread_arena;
+
+/*
+ * One outstanding probe, keyed by target, port and probe. Sixteen bytes, so
+ * four share a cache line; a zero port marks a free slot.
+ */
+typedef struct {
+    uint32_t addr;              /* Network byte order */
+    uint16_t port;
+    uint16_t probe_id;
+    uint32_t sent_usec;         /* Monotonic send time, wrapping every 71 minutes */
+    uint16_t timeout_ms;
+    uint8_t attempt;
+    uint8_t pad;
+} inflight_entry_t;
+
+_Static_assert(sizeof(inflight_entry_t) == 16, "in-flight entries must stay 16 bytes");
+
+/*
+ * Probes of one scanning thread awaiting an answer: open addressing with
+ * linear probing in one flat array, sized once from the probe rate and the
+ * longest timeout. Removal shifts the rest of the cluster back rather than
+ * leaving tombstones, so lookups never slow down as probes come and go.
+ */
+typedef struct {
+    inflight_entry_t *slots;
+    size_t mapped;              /* Bytes mapped for slots */
+    uint32_t mask;              /* Slots - 1 */
+    uint32_t count;
+    uint32_t limit;             /* Inserts fail beyond this many entries */
+    unsigned shift;             /* 64 - log2(slots), for the multiplicative hash */
+} inflight_table_t;
+
+static _Thread_local inflight_table_t *thread_inflight;
+
+/* Where and how the flight recorder is dumped */
+typedef struct {
+    char path[PATH_MAX];
+    uint64_t clock_start;       /* Event clock and monotonic ns at start, */
+    uint64_t mono_start;        /* to measure the event clock's rate */
+} flight_dump_t;
+
+static flight_dump_t flight;
+
+/* What a replayed capture says about one probed port */
+typedef struct {
+    uint64_t sent_nsec;         /* Capture time of the latest probe; 0 if never probed */
+    uint64_t payload_off;       /* Offset of the reply payload in the capture file */
+    uint32_t payload_len;       /* Captured reply payload bytes */
+    int32_t rtt_usec;
+    int32_t bytes;
+    uint16_t sport;             /* Source port of the latest probe */
+    int8_t state;               /* port_state_t of the answer, -1 until one arrives */
+    int8_t icmp_type;
+    int8_t icmp_code;
+} replay_port_t;
+
+/* Replay state of one probed address, in the order targets first appear */
+typedef struct replay_target {
+    struct in_addr addr;
+    replay_port_t *ports;       /* Indexed by port */
+    struct replay_target *next;
+} replay_target_t;
+
+static progress_reporter_t progress = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/* Where a result's RTT was measured */
+typedef enum {
+    RTT_SOURCE_USER,            /* clock_gettime() around sendto()/select() */
+    RTT_SOURCE_KERNEL,          /* Kernel software TX and RX timestamps */
+    RTT_SOURCE_HW               /* NIC hardware TX and RX timestamps */
+} rtt_source_t;
+
+static const char *const rtt_source_names[] = { "user", "kernel", "hardware" };
+
+/* When a probe left, by every clock that recorded it */
+typedef struct {
+    struct timespec sent;       /* CLOCK_MONOTONIC just before sendto() */
+    struct timespec tx;         /* Kernel software TX timestamp (CLOCK_REALTIME) */
+    struct timespec tx_hw;      /* NIC TX timestamp; zero when unavailable */
+} probe_timing_t;
+
+/*
+ * Smoothed RTT of the target (RFC 6298) that sets the probe timeout.
+ * The scanner has a single target, so this is the per-host state.
+ */
+typedef struct {
+    long srtt_usec;
+    long rttvar_usec;
+    long samples;
+    long kernel_samples;        /* Samples taken from kernel or NIC timestamps */
+} host_rtt_t;
+
+static host_rtt_t host_rtt = {0};
+
+/* Final result for one scanned port, as handed to the output code */
+typedef struct {
+    struct in_addr target;
     int port;
+    port_state_t state;
+    const char *service_name;   /* NULL when no probe matches the port */
+    const char *probe_name;
+    int probe_id;               /* Index into udp_probes[]; PROBE_ID_GENERIC otherwise */
+    long rtt_usec;              /* -1 when nothing was received */
+    rtt_source_t rtt_source;
+    ssize_t bytes;              /* UDP payload bytes received */
+    const char *banner;         /* Printable start of the reply, in the thread's arena; or NULL */
+    int icmp_type;              /* -1 when no ICMP error was received */
+    int icmp_code;
+} scan_result_t;
 
-    if (argc != 4) {
-        print_usage(argv[0]);
-        return 1;
-    }
+/* Output buffer handed from a scanning thread to a writer thread */
+typedef struct out_chunk {
+    struct out_chunk *next;
+    size_t len;
+    unsigned records;           /* Results formatted into data */
+    char data[];
+} out_chunk_t;
 
-    target_ip = argv[1];
-    start_port = atoi(argv[2]);
-    end_port = atoi(argv[3]);
+/* What a bounded writer does with a buffer once its queue is full */
+typedef enum {
+    OVERFLOW_BLOCK,             /* Wait for the consumer; stalls the scan */
+    OVERFLOW_DROP,              /* Discard the buffer and count its records */
+    OVERFLOW_SPILL              /* Append to a spill file replayed in order later */
+} overflow_policy_t;
 
-    if (start_port < 1 || start_port > 65535 || 
-        end_port < 1 || end_port > 65535 ||
-        start_port > end_port) {
-        fprintf(stderr, "Error: Invalid port range (1-65535)\n");
-        return 1;
-    }
+/* Queue bounds of a writer; all zero means large buffers and no bound */
+typedef struct {
+    size_t chunk_size;          /* 0: OUTPUT_CHUNK_SIZE */
+    int queue_limit;            /* Queued buffers before the policy applies; 0: unbounded */
+    overflow_policy_t policy;
+    int spill_fd;               /* OVERFLOW_SPILL: unlinked temporary file */
+    int gzip;                   /* Compress everything written to fd */
+} writer_limits_t;
 
-    /* Check if running as root */
-    if (geteuid() != 0) {
-        fprintf(stderr, "Warning: Not running as root. ICMP detection will fail.\n");
-        fprintf(stderr, "Run with sudo for accurate results.\n\n");
-    }
+/* Background writer draining full output buffers to a file descriptor */
+typedef struct {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t space;       /* Signalled when the writer empties its queue */
+    out_chunk_t *queue_head;
+    out_chunk_t *queue_tail;
+    int queued;
+    out_chunk_t *free_chunks;
+    int free_count;
+    writer_limits_t limits;
+    int spilling;               /* New buffers go to the spill file until it drains */
+    off_t spill_len;            /* Bytes in the spill file */
+    off_t spill_off;            /* Bytes of it already written to fd */
+    unsigned long spilled;      /* Records that went through the spill file */
+    unsigned long overflowed;   /* Records dropped by OVERFLOW_DROP */
+#ifdef HAVE_ZLIB
+    z_stream *zs;               /* gzip state, owned by the writer thread */
+    unsigned char *zbuf;        /* Compressed output, chunk_size bytes */
+#endif
+    int closing;
+    int write_errno;            /* First write error, owned by the writer thread */
+} async_writer_t;
 
-    printf("Starting UDP scan on %s\n", target_ip);
-    printf("Scanning ports %d-%d\n", start_port, end_port);
-    printf("Using protocol-specific probes for service detection\n\n");
+/* Output sink: one destination fed with every structured result */
+typedef struct output_sink output_sink_t;
 
-    gettimeofday(&stats.start_time, NULL);
+/* Output format callbacks; they return the bytes written to out, or -1 */
+typedef struct {
+    const char *name;
+    int (*open)(output_sink_t *sink);       /* NULL: create or truncate path */
+    int (*header)(output_sink_t *sink, char *out, size_t size);
+    int (*format)(output_sink_t *sink, const scan_result_t *r, char *out, size_t size);
+    int (*footer)(output_sink_t *sink, char *out, size_t size);
+    int (*close)(output_sink_t *sink);      /* Runs once the writer has drained */
+    int complete;                           /* Gets every result, whatever --states says */
+} output_format_t;
 
-    /* Scan ports */
-    for (port = start_port; port <= end_port; port++) {
-        scan_udp_port(target_ip, port);
-        stats.total_ports++;
-        
-        /* Rate limiting to avoid overwhelming target */
-        usleep(10000); // 10ms delay between scans
-    }
+/* Run of consecutive ports sharing one state, collapsed by --ranges */
+typedef struct {
+    int active;
+    scan_result_t first;        /* Printed as a normal line if the run stays one port long */
+    int last_port;
+} port_run_t;
+
+struct output_sink {
+    const output_format_t *format;
+    const char *path;           /* NULL for standard output */
+    int line_flush;             /* Hand every record to the writer immediately */
+    unsigned long dropped;
+    port_run_t run;
+    char segment[PATH_MAX];     /* --history: segment file of this scan */
+    writer_limits_t limits;
+    async_writer_t writer;
+};
+
+#define STATE_MASK_ALL ((1u << PORT_OPEN) | (1u << PORT_OPEN_FILTERED) | \
+                        (1u << PORT_CLOSED) | (1u << PORT_FILTERED))
+
+/* Command line options */
+typedef struct {
+    struct in_addr target;
+    int start_port;
+    int end_port;
+    unsigned state_mask;        /* Bit per port_state_t that gets reported */
+    int ranges;                 /* Collapse runs of non-open states in text output */
+    const char *baseline_path;  /* Previous results for an incremental re-scan */
+    long baseline_max_age;      /* Seconds a baseline CLOSED result stays trusted */
+    const char *stream_path;    /* Unix socket or FIFO fed with live results */
+    const char *stream_format;  /* "json" or "binary" */
+    overflow_policy_t stream_policy;
+    int stream_queue;           /* Records held in memory for a slow consumer */
+    const char *pcap_path;      /* Capture of sent and received packets */
+    const char *replay_path;    /* Classify a capture instead of scanning */
+    const char *flight_path;    /* Flight recorder dump; NULL for the default name */
+    const char *state_path;     /* Port state store to resume from and update */
+    int huge_pages;             /* Back large engine tables with huge pages (benchmark -H) */
+} scan_config_t;
+
+scan_config_t config = {
+    .state_mask = STATE_MASK_ALL,
+    .ranges = 0,
+    .baseline_max_age = BASELINE_MAX_AGE_HOURS * 3600L,
+    .stream_format = "json",
+    .stream_policy = OVERFLOW_DROP,
+    .stream_queue = STREAM_QUEUE_RECORDS
+};
+
+/* How much effort a port gets in an incremental re-scan */
+typedef enum {
+    PLAN_FULL,                  /* New or unresolved: full retry budget */
+    PLAN_FAST,                  /* Open last time: short first timeout */
+    PLAN_SKIP                   /* Recently confirmed closed: not probed */
+} probe_plan_t;
+
+/* Latest baseline result per port of the current target */
+typedef struct {
+    uint8_t state;
+    uint8_t known;
+    uint32_t time;
+    uint32_t rtt_usec;          /* 0 when the baseline had no RTT */
+} baseline_port_t;
+
+static baseline_port_t *baseline = NULL;
+
+/*
+ * Two-bit state of every (host, port) of the scan, with the full records of
+ * open ports in a side table: open ports are rare, so 65536 hosts of every
+ * port take 1 GB rather than a record each. The store exists only with
+ * --state: the header and bitmap are a shared mapping of the file and open
+ * records are appended to it.
+ */
+typedef struct {
+    unsigned char *map;         /* Header page, then the bitmap */
+    size_t map_size;
+    scan_state_header_t *header;
+    uint8_t *bitmap;
+    uint32_t first_host;        /* First address, host byte order */
+    uint32_t hosts;
+    int fd;                     /* -1 while no store is open */
+    scan_log_record_t *open;    /* Side table of open ports */
+    size_t open_alloc;
+    long open_resumed;          /* Open ports already in the file */
+} port_store_t;
+
+static port_store_t store = { .fd = -1 };
+
+_Static_assert(sizeof(scan_state_header_t) + (PROBE_ID_GENERIC + 1) * sizeof(scan_log_probe_t) <=
+               SCAN_STATE_BITMAP_OFFSET, "probe table must fit the state store header page");
+
+/* Pages behind an engine table */
+typedef enum {
+    PAGES_SMALL,
+    PAGES_THP,                  /* madvise(MADV_HUGEPAGE) */
+    PAGES_HUGETLB,              /* Reserved hugetlbfs pages */
+    PAGES_FILE                  /* Shared mapping of a file */
+} page_mode_t;
+
+static const char *const page_mode_names[] = {
+    "small pages", "transparent huge pages", "MAP_HUGETLB", "file mapping"
+};
+
+/* Engine tables allocated so far, for the statistics */
+typedef struct {
+    const char *what;
+    size_t size;
+    page_mode_t mode;
+} engine_table_t;
+
+static engine_table_t engine_tables[MAX_ENGINE_TABLES];
+static int engine_table_count;
+static pthread_mutex_t engine_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define MAX_SINKS 8
+
+static output_sink_t sinks[MAX_SINKS];
+static int sink_count = 0;
+static _Thread_local out_chunk_t *sink_chunks[MAX_SINKS];
+
+/* Write a whole buffer, remembering the first error; later writes are skipped */
+static void writer_write_fd(async_writer_t *w, const char *data, size_t len) {
+    size_t off = 0;
+
+    while (off < len && w->write_errno == 0) {
+        ssize_t n = write(w->fd, data + off, len - off);
+        if (n < 0) {
+            if (errno != EINTR)
+                w->write_errno = errno;
+            continue;
+        }
+        off += n;
+    }
+}
+
+#ifdef HAVE_ZLIB
+/* Feed data through the gzip stream, writing out every full output block */
+static void writer_deflate(async_writer_t *w, const char *data, size_t len, int flush) {
+    w->zs->next_in = (Bytef *)data;
+    w->zs->avail_in = len;
+    do {
+        w->zs->next_out = w->zbuf;
+        w->zs->avail_out = w->limits.chunk_size;
+        if (deflate(w->zs, flush) == Z_STREAM_ERROR) {
+            if (w->write_errno == 0)
+                w->write_errno = EIO;
+            return;
+        }
+        writer_write_fd(w, (const char *)w->zbuf, w->limits.chunk_size - w->zs->avail_out);
+    } while (w->zs->avail_out == 0);
+}
+#endif
+
+/* Write a whole buffer to the destination, compressing it if asked to */
+static void writer_write_all(async_writer_t *w, const char *data, size_t len) {
+#ifdef HAVE_ZLIB
+    if (w->zs != NULL) {
+        writer_deflate(w, data, len, Z_NO_FLUSH);
+        return;
+    }
+#endif
+    writer_write_fd(w, data, len);
+}
+
+/* Return a buffer to the pool; called with the lock held */
+static void writer_recycle(async_writer_t *w, out_chunk_t *c) {
+    if (w->free_count < OUTPUT_POOL_CHUNKS) {
+        c->next = w->free_chunks;
+        w->free_chunks = c;
+        w->free_count++;
+    } else {
+        free(c);
+    }
+}
+
+/* Forward one piece of the spill file; called with the lock held */
+static void writer_replay_spill(async_writer_t *w, char *buf) {
+    off_t off = w->spill_off;
+    size_t len = w->spill_len - off < (off_t)w->limits.chunk_size ?
+                 (size_t)(w->spill_len - off) : w->limits.chunk_size;
+    ssize_t n;
+
+    /* Bytes below spill_len are never rewritten, so they can be read unlocked */
+    pthread_mutex_unlock(&w->lock);
+    n = pread(w->limits.spill_fd, buf, len, off);
+    if (n > 0)
+        writer_write_all(w, buf, n);
+    else if (w->write_errno == 0)
+        w->write_errno = n < 0 ? errno : EIO;
+    pthread_mutex_lock(&w->lock);
+
+    w->spill_off += n > 0 ? n : (off_t)len;
+    if (w->spill_off >= w->spill_len) {
+        /* Caught up: start the spill file over and queue in memory again */
+        if (ftruncate(w->limits.spill_fd, 0) < 0 && w->write_errno == 0)
+            w->write_errno = errno;
+        w->spill_len = w->spill_off = 0;
+        w->spilling = 0;
+    }
+}
+
+/* Writer thread: drain queued buffers with large sequential writes */
+static void *writer_thread(void *arg) {
+    async_writer_t *w = arg;
+    out_chunk_t *batch;
+    char *spill_buf = NULL;
+
+    if (w->limits.policy == OVERFLOW_SPILL)
+        spill_buf = malloc(w->limits.chunk_size);
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->queue_head == NULL && w->spill_len == 0 && !w->closing)
+            pthread_cond_wait(&w->cond, &w->lock);
+
+        /* Taken buffers still count against the queue until they are written */
+        batch = w->queue_head;
+        w->queue_head = w->queue_tail = NULL;
+
+        /* Spilled data is newer than anything queued in memory */
+        if (batch == NULL && w->spill_len > 0) {
+            if (spill_buf != NULL) {
+                writer_replay_spill(w, spill_buf);
+                continue;
+            }
+            w->write_errno = ENOMEM;
+            w->spill_len = 0;
+        }
+        if (batch == NULL)
+            break;
+        pthread_mutex_unlock(&w->lock);
+
+        for (out_chunk_t *c = batch; c != NULL; c = c->next)
+            writer_write_all(w, c->data, c->len);
+
+        /* Recycle buffers, trimming anything allocated during a backlog */
+        pthread_mutex_lock(&w->lock);
+        while (batch != NULL) {
+            out_chunk_t *next = batch->next;
+            writer_recycle(w, batch);
+            w->queued--;
+            batch = next;
+        }
+        pthread_cond_broadcast(&w->space);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+#ifdef HAVE_ZLIB
+    if (w->zs != NULL) {
+        writer_deflate(w, NULL, 0, Z_FINISH);
+        deflateEnd(w->zs);
+    }
+#endif
+    free(spill_buf);
+    return NULL;
+}
+
+#ifdef HAVE_ZLIB
+/* Set up the gzip stream of a writer; the writer thread does all the work */
+static int writer_gzip_init(async_writer_t *w) {
+    w->zs = calloc(1, sizeof(*w->zs));
+    w->zbuf = malloc(w->limits.chunk_size);
+    if (w->zs == NULL || w->zbuf == NULL ||
+        deflateInit2(w->zs, OUTPUT_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(w->zs);
+        free(w->zbuf);
+        w->zs = NULL;
+        w->zbuf = NULL;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/* Start a writer thread for an open file descriptor; limits may be NULL */
+int writer_open(async_writer_t *w, int fd, const writer_limits_t *limits) {
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    if (limits != NULL)
+        w->limits = *limits;
+    else
+        w->limits.spill_fd = -1;
+    if (w->limits.chunk_size == 0)
+        w->limits.chunk_size = OUTPUT_CHUNK_SIZE;
+#ifdef HAVE_ZLIB
+    if (w->limits.gzip && writer_gzip_init(w) < 0)
+        return -1;
+#endif
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    pthread_cond_init(&w->space, NULL);
+
+    if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        pthread_cond_destroy(&w->space);
+#ifdef HAVE_ZLIB
+        if (w->zs != NULL)
+            deflateEnd(w->zs);
+        free(w->zs);
+        free(w->zbuf);
+#endif
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Get an empty buffer; never waits for the writer, allocates instead */
+out_chunk_t *writer_get_chunk(async_writer_t *w) {
+    out_chunk_t *c;
+
+    pthread_mutex_lock(&w->lock);
+    c = w->free_chunks;
+    if (c != NULL) {
+        w->free_chunks = c->next;
+        w->free_count--;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    if (c == NULL) {
+        c = malloc(sizeof(*c) + w->limits.chunk_size);
+        if (c == NULL)
+            return NULL;
+    }
+
+    c->next = NULL;
+    c->len = 0;
+    c->records = 0;
+    return c;
+}
+
+/*
+ * Apply the overflow policy to a buffer that does not fit the queue.
+ * Returns 1 when the buffer was consumed, 0 when it should be queued.
+ * Called with the lock held.
+ */
+static int writer_overflow(async_writer_t *w, out_chunk_t *c) {
+    if (w->limits.queue_limit == 0)
+        return 0;
+
+    if (w->limits.policy == OVERFLOW_BLOCK) {
+        while (w->queued >= w->limits.queue_limit)
+            pthread_cond_wait(&w->space, &w->lock);
+        return 0;
+    }
+
+    if (!w->spilling && w->queued < w->limits.queue_limit)
+        return 0;
+
+    /* Spill writes go to the page cache, never to the slow consumer */
+    if (w->limits.policy == OVERFLOW_SPILL &&
+        pwrite(w->limits.spill_fd, c->data, c->len, w->spill_len) == (ssize_t)c->len) {
+        w->spill_len += c->len;
+        w->spilled += c->records;
+        w->spilling = 1;
+        pthread_cond_signal(&w->cond);
+    } else {
+        w->overflowed += c->records;
+    }
+    writer_recycle(w, c);
+    return 1;
+}
+
+/* Queue a filled buffer for the writer thread */
+void writer_submit(async_writer_t *w, out_chunk_t *c) {
+    c->next = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (!writer_overflow(w, c)) {
+        if (w->queue_tail != NULL)
+            w->queue_tail->next = c;
+        else
+            w->queue_head = c;
+        w->queue_tail = c;
+        w->queued++;
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Drain the queue, stop the writer thread and close its descriptor */
+int writer_close(async_writer_t *w) {
+    pthread_mutex_lock(&w->lock);
+    w->closing = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->thread, NULL);
+
+    while (w->free_chunks != NULL) {
+        out_chunk_t *next = w->free_chunks->next;
+        free(w->free_chunks);
+        w->free_chunks = next;
+    }
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    pthread_cond_destroy(&w->space);
+#ifdef HAVE_ZLIB
+    free(w->zs);
+    free(w->zbuf);
+#endif
+
+    if (w->limits.spill_fd >= 0)
+        close(w->limits.spill_fd);
+    if (close(w->fd) < 0 && w->write_errno == 0)
+        w->write_errno = errno;
+
+    return w->write_errno;
+}
+
+/* Format one result as a JSON Lines record */
+int format_json(output_sink_t *sink, const scan_result_t *r, char *out, size_t size) {
+    char addr[INET_ADDRSTRLEN];
+    char service[32] = "null";
+    char rtt[24] = "null";
+    char icmp_type[12] = "null";
+    char icmp_code[12] = "null";
+    char banner[BANNER_MAX + 3] = "null";
+
+    (void)sink;
+    inet_ntop(AF_INET, &r->target, addr, sizeof(addr));
+    if (r->service_name)
+        snprintf(service, sizeof(service), "\"%s\"", r->service_name);
+    if (r->rtt_usec >= 0)
+        snprintf(rtt, sizeof(rtt), "%ld", r->rtt_usec);
+    if (r->icmp_type >= 0) {
+        snprintf(icmp_type, sizeof(icmp_type), "%d", r->icmp_type);
+        snprintf(icmp_code, sizeof(icmp_code), "%d", r->icmp_code);
+    }
+    if (r->banner)
+        snprintf(banner, sizeof(banner), "\"%s\"", r->banner);
+
+    return snprintf(out, size,
+                    "{\"target\":\"%s\",\"port\":%d,\"state\":\"%s\","
+                    "\"service\":%s,\"probe\":\"%s\",\"rtt_us\":%s,\"rtt_source\":%s%s%s,"
+                    "\"bytes\":%zd,\"icmp_type\":%s,\"icmp_code\":%s,\"banner\":%s}\n",
+                    addr, r->port, scan_state_name(r->state),
+                    service, r->probe_name, rtt,
+                    r->rtt_usec >= 0 ? "\"" : "",
+                    r->rtt_usec >= 0 ? rtt_source_names[r->rtt_source] : "null",
+                    r->rtt_usec >= 0 ? "\"" : "",
+                    r->bytes, icmp_type, icmp_code, banner);
+}
+
+/* Format one result as a human-readable line */
+int format_text_line(const scan_result_t *r, char *out, size_t size) {
+    const char *service = r->service_name ? r->service_name : "unknown";
+
+    switch (r->state) {
+    case PORT_OPEN:
+        return snprintf(out, size, "[OPEN] Port %d/udp %s (service responded: %zd bytes)\n",
+                        r->port, service, r->bytes);
+    case PORT_OPEN_FILTERED:
+        return snprintf(out, size, "[OPEN|FILTERED] Port %d/udp %s (no response)\n",
+                        r->port, service);
+    case PORT_CLOSED:
+        return snprintf(out, size, "[CLOSED] Port %d/udp (ICMP port unreachable)\n", r->port);
+    case PORT_FILTERED:
+        return snprintf(out, size, "[FILTERED] Port %d/udp (ICMP unreachable type %d, code %d)\n",
+                        r->port, r->icmp_type, r->icmp_code);
+    }
+    return -1;
+}
+
+/* Print and clear the sink's pending run; returns 0 when there is none */
+int format_text_run(output_sink_t *sink, char *out, size_t size) {
+    static const char *labels[] = {"OPEN", "OPEN|FILTERED", "CLOSED", "FILTERED"};
+    port_run_t *run = &sink->run;
+    int first_port = run->first.port;
+
+    if (!run->active)
+        return 0;
+
+    run->active = 0;
+    if (run->last_port == first_port)
+        return format_text_line(&run->first, out, size);
+
+    return snprintf(out, size, "[%s] Ports %d-%d/udp (%d ports)\n",
+                    labels[run->first.state], first_port, run->last_port,
+                    run->last_port - first_port + 1);
+}
+
+/*
+ * Text sink. With --ranges, consecutive ports sharing a non-open state are
+ * held as a single pending run and printed as one line when the run breaks,
+ * so memory stays constant however many ports are scanned.
+ */
+int format_text(output_sink_t *sink, const scan_result_t *r, char *out, size_t size) {
+    port_run_t *run = &sink->run;
+    int n;
+
+    if (!config.ranges)
+        return format_text_line(r, out, size);
+
+    if (run->active && r->state != PORT_OPEN &&
+        r->state == run->first.state && r->port == run->last_port + 1) {
+        run->last_port = r->port;
+        return 0;
+    }
+
+    n = format_text_run(sink, out, size);
+    if (n < 0 || (size_t)n >= size)
+        return -1;
+
+    if (r->state == PORT_OPEN) {
+        int m = format_text_line(r, out + n, size - n);
+        return m < 0 ? -1 : n + m;
+    }
+
+    run->active = 1;
+    run->first = *r;
+    run->first.banner = NULL;   /* Outlives the arena; runs never print it */
+    run->last_port = r->port;
+    return n;
+}
+
+int format_csv_header(output_sink_t *sink, char *out, size_t size) {
+    (void)sink;
+    return snprintf(out, size, "target,port,state,service,probe,rtt_us,bytes,icmp_type,icmp_code,banner\n");
+}
+
+/* Format one result as a CSV row; absent values are empty fields */
+int format_csv(output_sink_t *sink, const scan_result_t *r, char *out, size_t size) {
+    char addr[INET_ADDRSTRLEN];
+    char rtt[24] = "";
+    char icmp[24] = ",";
+
+    (void)sink;
+    inet_ntop(AF_INET, &r->target, addr, sizeof(addr));
+    if (r->rtt_usec >= 0)
+        snprintf(rtt, sizeof(rtt), "%ld", r->rtt_usec);
+    if (r->icmp_type >= 0)
+        snprintf(icmp, sizeof(icmp), "%d,%d", r->icmp_type, r->icmp_code);
+
+    return snprintf(out, size, "%s,%d,%s,%s,%s,%s,%zd,%s,%s\n",
+                    addr, r->port, scan_state_name(r->state),
+                    r->service_name ? r->service_name : "", r->probe_name,
+                    rtt, r->bytes, icmp, r->banner ? r->banner : "");
+}
+
+int format_xml_header(output_sink_t *sink, char *out, size_t size) {
+    (void)sink;
+    return snprintf(out, size, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<udpscan>\n");
+}
+
+/* Format one result as a <port> element; absent values are omitted */
+int format_xml(output_sink_t *sink, const scan_result_t *r, char *out, size_t size) {
+    char addr[INET_ADDRSTRLEN];
+    char service[48] = "";
+    char rtt[32] = "";
+    char icmp[48] = "";
+    char banner[BANNER_MAX + 12] = "";
+
+    (void)sink;
+    inet_ntop(AF_INET, &r->target, addr, sizeof(addr));
+    if (r->service_name)
+        snprintf(service, sizeof(service), " service=\"%s\"", r->service_name);
+    if (r->banner)
+        snprintf(banner, sizeof(banner), " banner=\"%s\"", r->banner);
+    if (r->rtt_usec >= 0)
+        snprintf(rtt, sizeof(rtt), " rtt_us=\"%ld\"", r->rtt_usec);
+    if (r->icmp_type >= 0)
+        snprintf(icmp, sizeof(icmp), " icmp_type=\"%d\" icmp_code=\"%d\"",
+                 r->icmp_type, r->icmp_code);
+
+    return snprintf(out, size,
+                    "  <port target=\"%s\" portid=\"%d\" protocol=\"udp\" state=\"%s\"%s"
+                    " probe=\"%s\"%s bytes=\"%zd\"%s%s/>\n",
+                    addr, r->port, scan_state_name(r->state), service,
+                    r->probe_name, rtt, r->bytes, icmp, banner);
+}
+
+int format_xml_footer(output_sink_t *sink, char *out, size_t size) {
+    (void)sink;
+    return snprintf(out, size, "</udpscan>\n");
+}
+
+/* Convert a result to its fixed-size binary log record */
+int format_binary(output_sink_t *sink, const scan_result_t *r, char *out, size_t size) {
+    scan_log_record_t rec;
+
+    (void)sink;
+    if (size < sizeof(rec))
+        return -1;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.addr = r->target.s_addr;
+    rec.time = (uint32_t)time(NULL);
+    rec.port = r->port;
+    rec.probe_id = r->probe_id;
+    rec.bytes = r->bytes > 0xFFFF ? 0xFFFF : (uint16_t)r->bytes;
+    rec.state = r->state;
+    if (r->bytes > 0)
+        rec.flags |= SCAN_REC_UDP_REPLY;
+    if (r->icmp_type >= 0) {
+        rec.flags |= SCAN_REC_ICMP;
+        rec.icmp_type = r->icmp_type;
+        rec.icmp_code = r->icmp_code;
+    }
+    if (r->rtt_usec >= 0) {
+        rec.flags |= SCAN_REC_RTT;
+        rec.rtt_usec = (uint32_t)r->rtt_usec;
+        if (r->rtt_source == RTT_SOURCE_KERNEL)
+            rec.flags |= SCAN_REC_RTT_KERNEL;
+        else if (r->rtt_source == RTT_SOURCE_HW)
+            rec.flags |= SCAN_REC_RTT_HW;
+    }
+
+    memcpy(out, &rec, sizeof(rec));
+    return sizeof(rec);
+}
+
+/* Get protocol-specific probe for port */
+udp_probe_t* get_probe_for_port(int port) {
+    for (int i = 0; udp_probes[i].service_name != NULL; i++) {
+        if (udp_probes[i].port == port) {
+            return &udp_probes[i];
+        }
+    }
+    return NULL;
+}
+
+/* Name every probe id, the generic probe last; returns the number of entries */
+unsigned probe_table_fill(scan_log_probe_t *probes) {
+    unsigned probe_count = PROBE_ID_GENERIC + 1;
+
+    memset(probes, 0, probe_count * sizeof(*probes));
+    for (unsigned i = 0; i < probe_count - 1; i++) {
+        strncpy(probes[i].service, udp_probes[i].service_name, sizeof(probes[i].service) - 1);
+        strncpy(probes[i].probe, udp_probes[i].probe_name, sizeof(probes[i].probe) - 1);
+    }
+    strncpy(probes[probe_count - 1].probe, "empty", sizeof(probes[0].probe) - 1);
+    return probe_count;
+}
+
+/* Build the header and probe table of a binary log into out (header_size bytes) */
+void binary_log_header(unsigned char *out) {
+    unsigned probe_count = PROBE_ID_GENERIC + 1;
+    scan_log_header_t *h = (scan_log_header_t *)out;
+
+    memset(out, 0, scan_log_header_size(probe_count));
+    memcpy(h->magic, SCAN_LOG_MAGIC, sizeof(h->magic));
+    h->version = SCAN_LOG_VERSION;
+    h->header_size = scan_log_header_size(probe_count);
+    h->record_size = sizeof(scan_log_record_t);
+    h->probe_count = probe_count;
+    h->byte_order = SCAN_LOG_BYTE_ORDER;
+    h->created = (uint64_t)time(NULL);
+    probe_table_fill((scan_log_probe_t *)(out + sizeof(*h)));
+}
+
+/* Write the header of a new binary log, or validate the one being appended to */
+int binary_log_init(int fd, const char *path) {
+    size_t header_size = scan_log_header_size(PROBE_ID_GENERIC + 1);
+    unsigned char *header;
+    scan_log_header_t *h;
+    scan_log_probe_t *probes;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: Cannot stat %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    header = malloc(header_size);
+    if (header == NULL) {
+        return -1;
+    }
+    binary_log_header(header);
+    h = (scan_log_header_t *)header;
+    probes = (scan_log_probe_t *)(header + sizeof(*h));
+
+    if (st.st_size == 0) {
+        if (write(fd, header, header_size) != (ssize_t)header_size) {
+            fprintf(stderr, "Error: Cannot write %s header: %s\n", path, strerror(errno));
+            goto fail;
+        }
+    } else {
+        /* Appending: the log must describe the same probe table */
+        unsigned char *existing = malloc(header_size);
+        const char *reason = NULL;
+        off_t records;
+
+        if (existing == NULL ||
+            pread(fd, existing, header_size, 0) != (ssize_t)header_size) {
+            reason = "not a scan log";
+        } else {
+            reason = scan_log_check_header((scan_log_header_t *)existing, st.st_size);
+            if (reason == NULL &&
+                memcmp(existing + sizeof(*h), probes, header_size - sizeof(*h)) != 0)
+                reason = "written with a different probe table";
+        }
+        free(existing);
+        if (reason != NULL) {
+            fprintf(stderr, "Error: Cannot append to %s: %s\n", path, reason);
+            goto fail;
+        }
+
+        /* Drop a torn record left behind by an interrupted scan */
+        records = (st.st_size - header_size) / sizeof(scan_log_record_t);
+        if (ftruncate(fd, header_size + records * sizeof(scan_log_record_t)) < 0) {
+            fprintf(stderr, "Error: Cannot truncate %s: %s\n", path, strerror(errno));
+            goto fail;
+        }
+    }
+
+    free(header);
+    return 0;
+
+fail:
+    free(header);
+    return -1;
+}
+
+/* Open a binary log for appending */
+int binary_log_open(output_sink_t *sink) {
+    int fd = open(sink->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", sink->path, strerror(errno));
+        return -1;
+    }
+    if (binary_log_init(fd, sink->path) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Read the committed entries of a history store manifest */
+int history_read_manifest(const char *dir, scan_history_entry_t **entries, size_t *count) {
+    char path[PATH_MAX];
+    scan_history_manifest_t m;
+    struct stat st;
+    int fd;
+
+    *entries = NULL;
+    *count = 0;
+    snprintf(path, sizeof(path), "%s/%s", dir, SCAN_HISTORY_MANIFEST);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    if (fstat(fd, &st) < 0 || read(fd, &m, sizeof(m)) != sizeof(m) ||
+        memcmp(m.magic, SCAN_HISTORY_MAGIC, sizeof(m.magic)) != 0 ||
+        m.version != SCAN_HISTORY_VERSION || m.entry_size != sizeof(scan_history_entry_t)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    *count = (st.st_size - sizeof(m)) / sizeof(scan_history_entry_t);
+    if (*count > 0) {
+        *entries = malloc(*count * sizeof(**entries));
+        if (*entries == NULL ||
+            read(fd, *entries, *count * sizeof(**entries)) != (ssize_t)(*count * sizeof(**entries))) {
+            free(*entries);
+            *entries = NULL;
+            close(fd);
+            return -1;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+/* Create this scan's segment in a history store under a fresh scan id */
+int history_open(output_sink_t *sink) {
+    scan_history_entry_t *entries;
+    size_t count;
+    uint32_t scan_id = 1;
+    int fd;
+
+    if (mkdir(sink->path, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", sink->path, strerror(errno));
+        return -1;
+    }
+
+    if (history_read_manifest(sink->path, &entries, &count) < 0) {
+        fprintf(stderr, "Error: %s is not a scan history store\n", sink->path);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].scan_id >= scan_id)
+            scan_id = entries[i].scan_id + 1;
+    }
+    free(entries);
+
+    /* O_EXCL settles races with scans running concurrently on the store */
+    for (;;) {
+        snprintf(sink->segment, sizeof(sink->segment), "%s/" SCAN_HISTORY_SEGMENT_FMT,
+                 sink->path, scan_id);
+        fd = open(sink->segment, O_RDWR | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+        if (fd >= 0 || errno != EEXIST)
+            break;
+        scan_id++;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", sink->segment, strerror(errno));
+        return -1;
+    }
+
+    if (binary_log_init(fd, sink->segment) < 0) {
+        close(fd);
+        unlink(sink->segment);
+        return -1;
+    }
+    return fd;
+}
+
+static int compare_records(const void *a, const void *b) {
+    uint64_t ka = scan_record_key(a);
+    uint64_t kb = scan_record_key(b);
+
+    return (ka > kb) - (ka < kb);
+}
+
+/*
+ * Connect to a result consumer: a listening Unix stream socket or a FIFO
+ * that already has a reader. The sink's limits decide what happens when
+ * the consumer falls behind.
+ */
+int stream_open(output_sink_t *sink) {
+    struct stat st;
+    int fd;
+
+    if (stat(sink->path, &st) < 0) {
+        fprintf(stderr, "Error: Cannot open stream %s: %s\n", sink->path, strerror(errno));
+        return -1;
+    }
+
+    if (S_ISSOCK(st.st_mode)) {
+        struct sockaddr_un addr;
+
+        if (strlen(sink->path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Error: Socket path %s is too long\n", sink->path);
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, sink->path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else if (S_ISFIFO(st.st_mode)) {
+        /* Fail with ENXIO instead of waiting for a reader to show up */
+        fd = open(sink->path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd >= 0)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    } else {
+        fprintf(stderr, "Error: %s is not a Unix socket or FIFO\n", sink->path);
+        return -1;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot connect to %s: %s\n", sink->path, strerror(errno));
+        return -1;
+    }
+
+    if (sink->limits.policy == OVERFLOW_SPILL) {
+        const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+        char spill[PATH_MAX];
+
+        snprintf(spill, sizeof(spill), "%s/udp_scanner-spill-XXXXXX", dir);
+        sink->limits.spill_fd = mkostemp(spill, O_CLOEXEC);
+        if (sink->limits.spill_fd < 0) {
+            fprintf(stderr, "Error: Cannot create spill file in %s: %s\n", dir, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        unlink(spill);
+    }
+
+    return fd;
+}
+
+/* Binary streams start with the same header and probe table as a binary log */
+int format_stream_binary_header(output_sink_t *sink, char *out, size_t size) {
+    size_t header_size = scan_log_header_size(PROBE_ID_GENERIC + 1);
+
+    (void)sink;
+    if (size <= header_size)
+        return -1;
+    binary_log_header((unsigned char *)out);
+    return header_size;
+}
+
+/* Sort the finished segment by (address, port) and commit it to the manifest */
+int history_commit(output_sink_t *sink) {
+    scan_history_entry_t entry;
+    scan_history_manifest_t m;
+    const scan_log_header_t *h;
+    scan_log_record_t *records;
+    unsigned char *map;
+    char path[PATH_MAX];
+    struct stat st;
+    size_t count;
+    int fd;
+
+    fd = open(sink->segment, O_RDWR | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        goto fail;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+    h = (const scan_log_header_t *)map;
+    records = (scan_log_record_t *)(map + h->header_size);
+    count = (st.st_size - h->header_size) / sizeof(*records);
+
+    /* A single ascending sweep is already in order; anything else is sorted here */
+    for (size_t i = 1; i < count; i++) {
+        if (scan_record_key(&records[i - 1]) > scan_record_key(&records[i])) {
+            qsort(records, count, sizeof(*records), compare_records);
+            break;
+        }
+    }
+    munmap(map, st.st_size);
+    if (fsync(fd) < 0) {
+        goto fail;
+    }
+    close(fd);
+
+    memset(&entry, 0, sizeof(entry));
+    entry.target = config.target.s_addr;
+    entry.started = stats.start_time.tv_sec;
+    entry.finished = time(NULL);
+    entry.records = count;
+    entry.start_port = config.start_port;
+    entry.end_port = config.end_port;
+    if (sscanf(strrchr(sink->segment, '/') + 1, SCAN_HISTORY_SEGMENT_FMT, &entry.scan_id) != 1) {
+        errno = EINVAL;
+        goto fail_quiet;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", sink->path, SCAN_HISTORY_MANIFEST);
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+        goto fail;
+    }
+    if (st.st_size == 0) {
+        memcpy(m.magic, SCAN_HISTORY_MAGIC, sizeof(m.magic));
+        m.version = SCAN_HISTORY_VERSION;
+        m.entry_size = sizeof(entry);
+        if (write(fd, &m, sizeof(m)) != sizeof(m)) {
+            goto fail;
+        }
+    }
+    if (write(fd, &entry, sizeof(entry)) != sizeof(entry) || fsync(fd) < 0) {
+        goto fail;
+    }
+    close(fd);
+
+    printf("Scan %u stored in %s (%zu records)\n", entry.scan_id, sink->path, count);
+    return 0;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+fail_quiet:
+    fprintf(stderr, "Error: Cannot commit scan to %s: %s\n", sink->path, strerror(errno));
+    return -1;
+}
+
+static const output_format_t output_formats[] = {
+    {"text",    NULL,            NULL,              format_text,   format_text_run,   NULL, 0},
+    {"json",    NULL,            NULL,              format_json,   NULL,              NULL, 0},
+    {"csv",     NULL,            format_csv_header, format_csv,    NULL,              NULL, 0},
+    {"xml",     NULL,            format_xml_header, format_xml,    format_xml_footer, NULL, 0},
+    {"binary",  binary_log_open, NULL,              format_binary, NULL,              NULL, 1},
+    {"history", history_open,    NULL,              format_binary, NULL,              history_commit, 1},
+    {"stream-json", stream_open, NULL,              format_json,   NULL,              NULL, 0},
+    {"stream-binary", stream_open, format_stream_binary_header, format_binary, NULL,  NULL, 0},
+    {NULL,      NULL,            NULL,              NULL,          NULL,              NULL, 0}
+};
+
+const output_format_t *find_output_format(const char *name) {
+    for (int i = 0; output_formats[i].name != NULL; i++) {
+        if (strcmp(output_formats[i].name, name) == 0) {
+            return &output_formats[i];
+        }
+    }
+    return NULL;
+}
+
+/* Make room for one record in this thread's buffer; full buffers go to the writer */
+out_chunk_t *chunk_reserve(async_writer_t *w, out_chunk_t **chunk) {
+    if (*chunk != NULL && w->limits.chunk_size - (*chunk)->len < OUTPUT_RECORD_MAX) {
+        writer_submit(w, *chunk);
+        *chunk = NULL;
+    }
+    if (*chunk == NULL)
+        *chunk = writer_get_chunk(w);
+    return *chunk;
+}
+
+/* Hand this thread's buffer to the writer if it holds anything */
+void chunk_flush(async_writer_t *w, out_chunk_t **chunk) {
+    if (*chunk == NULL || (*chunk)->len == 0)
+        return;
+
+    writer_submit(w, *chunk);
+    *chunk = NULL;
+}
+
+/* Register a sink; path NULL means standard output */
+int output_add_sink(const char *format_name, const char *path) {
+    const output_format_t *format = find_output_format(format_name);
+
+    if (format == NULL || sink_count == MAX_SINKS) {
+        return -1;
+    }
+
+    memset(&sinks[sink_count], 0, sizeof(sinks[0]));
+    sinks[sink_count].format = format;
+    sinks[sink_count].path = path;
+    sinks[sink_count].line_flush = (path == NULL && isatty(STDOUT_FILENO));
+    sinks[sink_count].limits.spill_fd = -1;
+
+    /* Plain file outputs named *.gz are compressed on their writer thread */
+    if (path != NULL && strlen(path) > 3 && strcmp(path + strlen(path) - 3, ".gz") == 0) {
+        if (format->open != NULL) {
+            /* Binary log, history and stream sinks write their own files */
+            fprintf(stderr, "Warning: %s output is never compressed, %s is written uncompressed\n",
+                    format->name, path);
+        } else {
+#ifdef HAVE_ZLIB
+            sinks[sink_count].limits.gzip = 1;
+#else
+            fprintf(stderr, "Warning: Built without zlib, %s is written uncompressed\n", path);
+#endif
+        }
+    }
+
+    sink_count++;
+    return 0;
+}
+
+/* Register the live result stream with a bounded, record-sized queue */
+int output_add_stream(const char *path, const char *format, overflow_policy_t policy,
+                      int queue) {
+    char name[32];
+    output_sink_t *sink;
+
+    snprintf(name, sizeof(name), "stream-%s", format);
+    if (output_add_sink(name, path) < 0)
+        return -1;
+
+    /* Results are pushed to the consumer as they happen */
+    sink = &sinks[sink_count - 1];
+    sink->line_flush = 1;
+    sink->limits.chunk_size = STREAM_CHUNK_SIZE;
+    sink->limits.queue_limit = queue;
+    sink->limits.policy = policy;
+    return 0;
+}
+
+/* Append formatter output to this thread's buffer for sink i */
+void output_append(int i, int (*fn)(output_sink_t *, char *, size_t)) {
+    output_sink_t *sink = &sinks[i];
+    out_chunk_t *c = chunk_reserve(&sink->writer, &sink_chunks[i]);
+    int n;
+
+    if (c == NULL) {
+        sink->dropped++;
+        return;
+    }
+
+    n = fn(sink, c->data + c->len, sink->writer.limits.chunk_size - c->len);
+    if (n >= 0 && (size_t)n < sink->writer.limits.chunk_size - c->len)
+        c->len += n;
+    else
+        sink->dropped++;
+}
+
+/* Open every sink's destination and start its writer thread */
+int output_open(void) {
+    for (int i = 0; i < sink_count; i++) {
+        output_sink_t *sink = &sinks[i];
+        int fd;
+
+        if (sink->format->open) {
+            fd = sink->format->open(sink);
+        } else if (sink->path) {
+            fd = open(sink->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+                fprintf(stderr, "Error: Cannot open %s: %s\n", sink->path, strerror(errno));
+        } else {
+            fd = dup(STDOUT_FILENO);
+        }
+        if (fd < 0) {
+            return -1;
+        }
+
+        if (writer_open(&sink->writer, fd, &sink->limits) < 0) {
+            fprintf(stderr, "Error: Cannot start output writer thread\n");
+            close(fd);
+            return -1;
+        }
+
+        if (sink->format->header) {
+            output_append(i, sink->format->header);
+        }
+    }
+
+    return 0;
+}
+
+/* Flush this thread's buffers, write footers and stop every writer */
+void output_close(void) {
+    for (int i = 0; i < sink_count; i++) {
+        output_sink_t *sink = &sinks[i];
+        const char *name = sink->path ? sink->path : "standard output";
+        int err;
+
+        if (sink->format->footer) {
+            output_append(i, sink->format->footer);
+        }
+        chunk_flush(&sink->writer, &sink_chunks[i]);
+        free(sink_chunks[i]);
+        sink_chunks[i] = NULL;
+
+        err = writer_close(&sink->writer);
+        if (err != 0) {
+            fprintf(stderr, "Error: Writing %s failed: %s\n", name, strerror(err));
+        } else if (sink->format->close) {
+            sink->format->close(sink);
+        }
+        if (sink->dropped + sink->writer.overflowed > 0) {
+            fprintf(stderr, "Warning: %lu %s records dropped for %s\n",
+                    sink->dropped + sink->writer.overflowed, sink->format->name, name);
+        }
+        if (sink->writer.spilled > 0) {
+            fprintf(stderr, "Note: %lu %s records were spilled to disk while %s lagged\n",
+                    sink->writer.spilled, sink->format->name, name);
+        }
+    }
+}
+
+/* Parse a comma separated list of state names into a report mask */
+unsigned parse_state_list(const char *list) {
+    unsigned mask = 0;
+    const char *p = list;
+
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        unsigned state;
+
+        /* Accept "open-filtered" so the shell needs no quoting */
+        for (state = PORT_OPEN; state <= PORT_FILTERED; state++) {
+            const char *name = scan_state_name(state);
+            size_t i;
+
+            if (strlen(name) != len)
+                continue;
+            for (i = 0; i < len; i++) {
+                char c = (p[i] == '-') ? '|' : p[i];
+                if (c != name[i])
+                    break;
+            }
+            if (i == len)
+                break;
+        }
+        if (state > PORT_FILTERED)
+            return 0;
+
+        mask |= 1u << state;
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+
+    return mask;
+}
+
+/* Account the final result for a port and hand it to every sink */
+void report_result(const scan_result_t *r) {
+    switch (r->state) {
+    case PORT_OPEN:
+        stats.open_ports++;
+        break;
+    case PORT_CLOSED:
+        stats.closed_ports++;
+        break;
+    case PORT_OPEN_FILTERED:
+    case PORT_FILTERED:
+        stats.filtered_ports++;
+        break;
+    }
+
+    /* The record is built once; each sink only formats it */
+    for (int i = 0; i < sink_count; i++) {
+        output_sink_t *sink = &sinks[i];
+        out_chunk_t *c;
+        int n;
+
+        /* --states only trims what is displayed; logs keep the whole scan */
+        if (!(config.state_mask & (1u << r->state)) && !sink->format->complete)
+            continue;
+
+        c = chunk_reserve(&sink->writer, &sink_chunks[i]);
+        if (c == NULL) {
+            sink->dropped++;
+            continue;
+        }
+
+        n = sink->format->format(sink, r, c->data + c->len, sink->writer.limits.chunk_size - c->len);
+        if (n >= 0 && (size_t)n < sink->writer.limits.chunk_size - c->len) {
+            c->len += n;
+            c->records++;
+        } else {
+            sink->dropped++;
+        }
+
+        if (sink->line_flush)
+            chunk_flush(&sink->writer, &sink_chunks[i]);
+    }
+}
+
+/* Merge one scan log into the baseline, keeping the newest result per port */
+static long baseline_merge(const char *path) {
+    const scan_log_header_t *h;
+    const scan_log_record_t *records;
+    const char *reason;
+    unsigned char *map;
+    struct stat st;
+    size_t count;
+    long used = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(scan_log_header_t)) {
+        fprintf(stderr, "Error: %s: not a scan log\n", path);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    h = (const scan_log_header_t *)map;
+    reason = scan_log_check_header(h, st.st_size);
+    if (reason != NULL) {
+        fprintf(stderr, "Error: %s: %s\n", path, reason);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    records = (const scan_log_record_t *)(map + h->header_size);
+    count = (st.st_size - h->header_size) / sizeof(*records);
+    for (size_t i = 0; i < count; i++) {
+        const scan_log_record_t *rec = &records[i];
+        baseline_port_t *b = &baseline[rec->port];
+
+        if (rec->addr != config.target.s_addr || (b->known && b->time > rec->time))
+            continue;
+        used += !b->known;
+        b->known = 1;
+        b->state = rec->state;
+        b->time = rec->time;
+        b->rtt_usec = (rec->flags & SCAN_REC_RTT) ? rec->rtt_usec : 0;
+    }
+    munmap(map, st.st_size);
+    return used;
+}
+
+/*
+ * Load the baseline for the target. A history store contributes every
+ * committed scan of the target, so ports skipped by one incremental run
+ * keep their older result for the next.
+ */
+int baseline_load(const char *path) {
+    struct stat st;
+    long ports = 0;
+
+    baseline = calloc(65536, sizeof(*baseline));
+    if (baseline == NULL)
+        return -1;
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        scan_history_entry_t *entries;
+        char segment[PATH_MAX];
+        size_t count;
+
+        errno = 0;
+        if (history_read_manifest(path, &entries, &count) < 0) {
+            fprintf(stderr, "Error: Cannot read the scan history manifest in %s: %s\n", path,
+                    errno != 0 ? strerror(errno) : "truncated manifest");
+            return -1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            long used;
+
+            if (entries[i].target != config.target.s_addr)
+                continue;
+            snprintf(segment, sizeof(segment), "%s/" SCAN_HISTORY_SEGMENT_FMT,
+                     path, entries[i].scan_id);
+            used = baseline_merge(segment);
+            if (used < 0) {
+                free(entries);
+                return -1;
+            }
+            ports += used;
+        }
+        free(entries);
+    } else {
+        ports = baseline_merge(path);
+        if (ports < 0)
+            return -1;
+    }
+
+    printf("Baseline: %ld known ports of %s from %s\n", ports, inet_ntoa(config.target), path);
+    return 0;
+}
+
+/* Decide how much effort a port deserves given the baseline */
+probe_plan_t baseline_plan(int port, long *first_timeout_usec) {
+    const baseline_port_t *b;
+
+    *first_timeout_usec = TIMEOUT_SEC * 1000000L + TIMEOUT_USEC;
+    if (baseline == NULL || !baseline[port].known)
+        return PLAN_FULL;
+
+    b = &baseline[port];
+    switch (b->state) {
+    case PORT_CLOSED:
+        if (time(NULL) - (long)b->time <= config.baseline_max_age)
+            return PLAN_SKIP;
+        return PLAN_FULL;
+    case PORT_OPEN:
+        if (b->rtt_usec > 0) {
+            long fast = (long)b->rtt_usec * FAST_TIMEOUT_RTT_FACTOR;
+            if (fast < FAST_TIMEOUT_MIN_USEC)
+                fast = FAST_TIMEOUT_MIN_USEC;
+            if (fast < *first_timeout_usec)
+                *first_timeout_usec = fast;
+        }
+        return PLAN_FAST;
+    default:
+        return PLAN_FULL;
+    }
+}
+
+void table_record(const char *what, size_t size, page_mode_t mode) {
+    pthread_mutex_lock(&engine_tables_lock);
+    if (engine_table_count < MAX_ENGINE_TABLES)
+        engine_tables[engine_table_count++] = (engine_table_t){ what, size, mode };
+    pthread_mutex_unlock(&engine_tables_lock);
+}
+
+/* Transparent huge pages can be had with madvise unless set to never */
+static int thp_available(void) {
+    char mode[128] = "";
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "re");
+
+    if (f == NULL)
+        return 0;
+    if (fgets(mode, sizeof(mode), f) == NULL)
+        mode[0] = '\0';
+    fclose(f);
+    return mode[0] != '\0' && strstr(mode, "[never]") == NULL;
+}
+
+/*
+ * Zeroed anonymous memory for a large, randomly accessed engine table.
+ * With config.huge_pages, tables of at least a huge page first try reserved
+ * hugetlbfs pages, then transparent huge pages on an aligned range, and
+ * otherwise get small pages. *mapped is the length to munmap.
+ */
+void *table_alloc(const char *what, size_t size, size_t *mapped) {
+    page_mode_t mode = PAGES_SMALL;
+    void *p = MAP_FAILED;
+    size_t len = size;
+
+    if (config.huge_pages && size >= HUGE_PAGE_SIZE) {
+        len = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            mode = PAGES_HUGETLB;
+        } else if (thp_available()) {
+            /* Map a huge page extra and trim it, so the range starts aligned */
+            unsigned char *raw = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+            if (raw != MAP_FAILED) {
+                size_t head = -(uintptr_t)raw & (HUGE_PAGE_SIZE - 1);
+
+                if (head > 0)
+                    munmap(raw, head);
+                munmap(raw + head + len, HUGE_PAGE_SIZE - head);
+                p = raw + head;
+                if (madvise(p, len, MADV_HUGEPAGE) == 0)
+                    mode = PAGES_THP;
+            }
+        }
+    }
+    if (p == MAP_FAILED) {
+        len = size;
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+    }
+
+    *mapped = len;
+    table_record(what, size, mode);
+    return p;
+}
+
+/* One line naming each engine table's size and pages */
+void engine_tables_report(void) {
+    if (engine_table_count == 0)
+        return;
+    printf("Engine tables:");
+    for (int i = 0; i < engine_table_count; i++) {
+        const engine_table_t *t = &engine_tables[i];
+
+        if (t->size >= (1u << 20))
+            printf(" %s %.1f MB (%s)", t->what, t->size / 1048576.0, page_mode_names[t->mode]);
+        else
+            printf(" %s %zu KB (%s)", t->what, t->size >> 10, page_mode_names[t->mode]);
+        printf("%s", i + 1 < engine_table_count ? "," : "\n");
+    }
+    if (config.huge_pages) {
+        int large = 0;
+
+        for (int i = 0; i < engine_table_count; i++)
+            large |= engine_tables[i].size >= HUGE_PAGE_SIZE;
+        if (large)
+            printf("Huge pages back tables of %u MB or more\n", HUGE_PAGE_SIZE >> 20);
+        else
+            printf("Huge pages unused: no table reaches %u MB\n", HUGE_PAGE_SIZE >> 20);
+    }
+}
+
+/* Slot of a port, or -1 if its address lies outside the store */
+static inline int port_store_get(const port_store_t *ps, uint32_t addr, int port) {
+    uint32_t host = ntohl(addr) - ps->first_host;
+
+    if (ps->bitmap == NULL || host >= ps->hosts)
+        return -1;
+    return scan_state_slot(ps->bitmap, host, port);
+}
+
+/*
+ * Record a finished port; the bitmap first, so a crash loses at most details.
+ * An open port whose record cannot be kept goes back to unscanned, so a
+ * resumed scan probes it again rather than list it open without details.
+ */
+void port_store_set(port_store_t *ps, const scan_result_t *r) {
+    static const uint8_t slot_of[] = {
+        [PORT_OPEN] = SCAN_SLOT_OPEN,
+        [PORT_OPEN_FILTERED] = SCAN_SLOT_OPEN_FILTERED,
+        [PORT_CLOSED] = SCAN_SLOT_CLOSED,
+        [PORT_FILTERED] = SCAN_SLOT_OPEN_FILTERED
+    };
+    uint32_t host = ntohl(r->target.s_addr) - ps->first_host;
+    unsigned shift = r->port % 4 * 2;
+    uint8_t *b;
+
+    if (ps->bitmap == NULL || host >= ps->hosts)
+        return;
+    b = &ps->bitmap[(size_t)host * SCAN_STATE_HOST_BYTES + r->port / 4];
+    *b = (*b & ~(3u << shift)) | slot_of[r->state] << shift;
+    if (r->state != PORT_OPEN)
+        return;
+
+    if (ps->header->open_count == ps->open_alloc) {
+        size_t alloc = ps->open_alloc ? ps->open_alloc * 2 : 64;
+        scan_log_record_t *open = realloc(ps->open, alloc * sizeof(*open));
+
+        if (open == NULL)
+            goto fail;
+        ps->open = open;
+        ps->open_alloc = alloc;
+    }
+    format_binary(NULL, r, (char *)&ps->open[ps->header->open_count], sizeof(*ps->open));
+    if (ps->fd >= 0) {
+        ssize_t n = pwrite(ps->fd, &ps->open[ps->header->open_count], sizeof(*ps->open),
+                           scan_state_open_offset(ps->hosts) +
+                           (off_t)ps->header->open_count * sizeof(*ps->open));
+
+        if (n != sizeof(*ps->open)) {
+            if (n >= 0)
+                errno = ENOSPC;
+            goto fail;
+        }
+    }
+    ps->header->open_count++;
+    return;
+
+fail:
+    fprintf(stderr, "Warning: Cannot store open port %d in the state store: %s\n",
+            r->port, strerror(errno));
+    *b &= ~(3u << shift);
+}
+
+/* Map an existing store and load its open records; returns the ports already scanned */
+static long port_store_load(port_store_t *ps, const char *path, size_t file_size) {
+    scan_log_probe_t probes[PROBE_ID_GENERIC + 1], stored[PROBE_ID_GENERIC + 1];
+    scan_state_header_t h;
+    const char *reason;
+    long scanned = 0;
+
+    if (pread(ps->fd, &h, sizeof(h), 0) != sizeof(h))
+        memset(&h, 0, sizeof(h));
+    reason = scan_state_check_header(&h, file_size);
+    if (reason != NULL) {
+        fprintf(stderr, "Error: %s: %s\n", path, reason);
+        return -1;
+    }
+    /* Stored probe ids only mean the same probes under this build's table */
+    if (h.probe_count != probe_table_fill(probes) ||
+        pread(ps->fd, stored, sizeof(stored), sizeof(h)) != (ssize_t)sizeof(stored) ||
+        memcmp(stored, probes, sizeof(probes)) != 0) {
+        fprintf(stderr, "Error: %s was written with a different probe table; "
+                "remove it to start over\n", path);
+        return -1;
+    }
+    ps->first_host = ntohl(h.first_addr);
+    ps->hosts = h.hosts;
+    ps->open_alloc = h.open_count;
+    ps->open_resumed = h.open_count;
+    if (h.open_count > 0) {
+        size_t bytes = (size_t)h.open_count * sizeof(*ps->open);
+
+        ps->open = malloc(bytes);
+        if (ps->open == NULL ||
+            pread(ps->fd, ps->open, bytes, scan_state_open_offset(h.hosts)) != (ssize_t)bytes) {
+            fprintf(stderr, "Error: Cannot read %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    /* Records past open_count are from an append cut short */
+    if (ftruncate(ps->fd, scan_state_open_offset(h.hosts) +
+                          (off_t)h.open_count * sizeof(*ps->open)) < 0) {
+        fprintf(stderr, "Error: Cannot truncate %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    ps->map_size = scan_state_open_offset(h.hosts);
+    ps->map = mmap(NULL, ps->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ps->fd, 0);
+    if (ps->map == MAP_FAILED) {
+        ps->map = NULL;
+        fprintf(stderr, "Error: Cannot map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    table_record("port states", ps->map_size, PAGES_FILE);
+    ps->header = (scan_state_header_t *)ps->map;
+    ps->bitmap = ps->map + SCAN_STATE_BITMAP_OFFSET;
+    for (size_t i = 0; i < (size_t)ps->hosts * SCAN_STATE_HOST_BYTES; i++) {
+        uint8_t b = ps->bitmap[i];
+
+        scanned += ((b & 0x03) != 0) + ((b & 0x0c) != 0) + ((b & 0x30) != 0) + ((b & 0xc0) != 0);
+    }
+    return scanned;
+}
+
+/*
+ * Open the store for `hosts` addresses from `first`, resuming the file at
+ * path if it exists (its own address range then applies).
+ */
+int port_store_open(port_store_t *ps, const char *path, struct in_addr first, uint32_t hosts) {
+    struct stat st;
+    long scanned;
+
+    ps->first_host = ntohl(first.s_addr);
+    ps->hosts = hosts;
+    ps->map_size = scan_state_open_offset(hosts);
+
+    ps->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (ps->fd < 0 || fstat(ps->fd, &st) < 0) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (st.st_size > 0) {
+        scanned = port_store_load(ps, path, st.st_size);
+        if (scanned < 0)
+            return -1;
+        if (port_store_get(ps, first.s_addr, 0) < 0) {
+            fprintf(stderr, "Error: %s holds no state for %s\n", path, inet_ntoa(first));
+            return -1;
+        }
+        printf("Resuming from %s: %ld ports already scanned, %ld open\n",
+               path, scanned, ps->open_resumed);
+        return 0;
+    }
+    if (ftruncate(ps->fd, ps->map_size) < 0) {
+        fprintf(stderr, "Error: Cannot size %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    ps->map = mmap(NULL, ps->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ps->fd, 0);
+    if (ps->map == MAP_FAILED) {
+        ps->map = NULL;
+        fprintf(stderr, "Error: Cannot map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    table_record("port states", ps->map_size, PAGES_FILE);
+
+    ps->header = (scan_state_header_t *)ps->map;
+    ps->bitmap = ps->map + SCAN_STATE_BITMAP_OFFSET;
+    memcpy(ps->header->magic, SCAN_STATE_MAGIC, sizeof(ps->header->magic));
+    ps->header->version = SCAN_STATE_VERSION;
+    ps->header->record_size = sizeof(scan_log_record_t);
+    ps->header->byte_order = SCAN_LOG_BYTE_ORDER;
+    ps->header->hosts = hosts;
+    ps->header->first_addr = first.s_addr;
+    ps->header->created = time(NULL);
+    ps->header->probe_count = probe_table_fill((scan_log_probe_t *)(ps->map + sizeof(*ps->header)));
+    return 0;
+}
+
+/*
+ * Rebuild the result of a port finished before the scan was resumed, so the
+ * outputs still cover it. Open ports come back from their record; the
+ * others only from their slot, which keeps no reply details and stores
+ * filtered as open|filtered. Returns -1 if the port is not in the store.
+ */
+int port_store_result(const port_store_t *ps, struct in_addr addr, int port, scan_result_t *r) {
+    int slot = port_store_get(ps, addr.s_addr, port);
+    udp_probe_t *probe = get_probe_for_port(port);
+
+    if (slot <= SCAN_SLOT_UNSCANNED)
+        return -1;
+
+    memset(r, 0, sizeof(*r));
+    r->target = addr;
+    r->port = port;
+    r->state = slot == SCAN_SLOT_CLOSED ? PORT_CLOSED : PORT_OPEN_FILTERED;
+    r->service_name = probe ? probe->service_name : NULL;
+    r->probe_name = probe ? probe->probe_name : "empty";
+    r->probe_id = probe ? probe - udp_probes : PROBE_ID_GENERIC;
+    r->rtt_usec = -1;
+    r->icmp_type = -1;
+    r->icmp_code = -1;
+    if (slot != SCAN_SLOT_OPEN)
+        return 0;
+
+    r->state = PORT_OPEN;
+    for (uint32_t i = 0; i < ps->header->open_count; i++) {
+        const scan_log_record_t *rec = &ps->open[i];
+
+        if (rec->addr != addr.s_addr || rec->port != port)
+            continue;
+        r->bytes = rec->bytes;
+        if (rec->flags & SCAN_REC_RTT) {
+            r->rtt_usec = rec->rtt_usec;
+            r->rtt_source = (rec->flags & SCAN_REC_RTT_HW) ? RTT_SOURCE_HW :
+                            (rec->flags & SCAN_REC_RTT_KERNEL) ? RTT_SOURCE_KERNEL :
+                            RTT_SOURCE_USER;
+        }
+        break;
+    }
+    return 0;
+}
+
+void port_store_close(port_store_t *ps) {
+    if (ps->map != NULL)
+        munmap(ps->map, ps->map_size);
+    if (ps->fd >= 0)
+        close(ps->fd);
+    free(ps->open);
+    ps->map = NULL;
+    ps->bitmap = NULL;
+    ps->fd = -1;
+}
+
+/* Microseconds elapsed since a CLOCK_MONOTONIC timestamp */
+long elapsed_usec(const struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000L +
+           (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+static arena_block_t *arena_block(void) {
+    arena_block_t *b = aligned_alloc(CACHE_LINE_SIZE, sizeof(*b) + ARENA_BLOCK_SIZE);
+
+    if (b != NULL) {
+        b->next = NULL;
+        b->used = 0;
+    }
+    return b;
+}
+
+/* Allocate the first block, so a thread's first results need no malloc */
+void arena_init(arena_t *a) {
+    if (a->first != NULL)
+        return;
+    a->first = a->cur = arena_block();
+    if (a->first == NULL) {
+        perror("result arena");
+        exit(1);
+    }
+}
+
+/* size bytes, 16-byte aligned, valid until the next arena_release; NULL if too big */
+void *arena_alloc(arena_t *a, size_t size) {
+    arena_block_t *b;
+
+    size = (size + 15) & ~(size_t)15;
+    if (size > ARENA_BLOCK_SIZE)
+        return NULL;
+    if (a->cur == NULL)
+        arena_init(a);
+
+    b = a->cur;
+    if (b->used + size > ARENA_BLOCK_SIZE) {
+        if (b->next == NULL && (b->next = arena_block()) == NULL)
+            return NULL;
+        b = a->cur = b->next;
+        b->used = 0;
+    }
+    b->used += size;
+    return b->data + b->used - size;
+}
+
+/* Free everything allocated since the last release, keeping the blocks */
+void arena_release(arena_t *a) {
+    a->cur = a->first;
+    if (a->cur != NULL)
+        a->cur->used = 0;
+}
+
+/*
+ * Copy the start of a reply into the arena as a banner: printable ASCII
+ * kept, anything else, and characters that need quoting in JSON, CSV or
+ * XML, shown as '.'.
+ */
+const char *banner_copy(arena_t *a, const unsigned char *data, size_t len) {
+    char *banner;
+
+    if (len > BANNER_MAX)
+        len = BANNER_MAX;
+    banner = arena_alloc(a, len + 1);
+    if (banner == NULL)
+        return NULL;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = data[i];
+
+        banner[i] = (c < 0x20 || c > 0x7e || c == '"' || c == '\\' || c == ',' ||
+                     c == '<' || c == '>' || c == '&' || c == '\'') ? '.' : c;
+    }
+    banner[len] = '\0';
+    return banner;
+}
+
+/* Give the calling thread its counter block; blocks live until exit */
+scan_counters_t *counters_register(void) {
+    scan_counters_t *c;
+
+    if (thread_counters != NULL)
+        return thread_counters;
+
+    c = aligned_alloc(CACHE_LINE_SIZE, sizeof(*c));
+    if (c == NULL) {
+        perror("counters");
+        exit(1);
+    }
+    memset(c, 0, sizeof(*c));
+    c->latency = calloc(1, sizeof(*c->latency));
+    if (c->latency == NULL) {
+        perror("latency histograms");
+        exit(1);
+    }
+    c->flight = calloc(1, sizeof(*c->flight));
+    if (c->flight == NULL) {
+        perror("flight recorder");
+        exit(1);
+    }
+    c->flight->tid = gettid();
+    arena_init(&thread_arena);
+
+    /* Published with release: the flight recorder's signal handler walks the list unlocked */
+    pthread_mutex_lock(&counters_lock);
+    c->next = counters_list;
+    __atomic_store_n(&counters_list, c, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&counters_lock);
+
+    thread_counters = c;
+    return c;
+}
+
+/* Single-writer update: plain load and store, no locked instruction */
+static inline void counter_add(_Atomic uint64_t *counter, int64_t delta) {
+    uint64_t v = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, v + delta, memory_order_relaxed);
+}
+
+static inline uint64_t counter_get(const _Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/* Event clock: the TSC where there is one, else the monotonic clock in ns */
+static inline uint64_t flight_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* Append an engine event to the calling thread's flight recorder */
+static inline void flight_record(uint8_t type, uint32_t addr, int port, int probe_id,
+                                 uint8_t aux, int64_t arg) {
+    flight_ring_t *r;
+    scan_flight_event_t *e;
+    uint64_t n;
+
+    if (thread_counters == NULL)
+        return;
+    r = thread_counters->flight;
+    n = counter_get(&r->recorded);
+    e = &r->events[n & (FLIGHT_EVENTS - 1)];
+    e->clock = flight_clock();
+    e->arg = arg;
+    e->addr = addr;
+    e->port = port;
+    e->probe_id = probe_id;
+    e->type = type;
+    e->aux = aux;
+    counter_add(&r->recorded, 1);
+}
+
+/* Count system calls made by the calling thread, if it scans */
+static inline void count_syscalls(syscall_kind_t kind, int n) {
+    if (thread_counters != NULL)
+        counter_add(&thread_counters->syscalls[kind], n);
+}
+
+/* Sum all counter blocks */
+void counters_sample(progress_sample_t *sample) {
+    memset(sample, 0, sizeof(*sample));
+
+    pthread_mutex_lock(&counters_lock);
+    for (scan_counters_t *c = counters_list; c != NULL; c = c->next) {
+        sample->probes_sent += atomic_load_explicit(&c->probes_sent, memory_order_relaxed);
+        sample->responses += atomic_load_explicit(&c->responses, memory_order_relaxed);
+        sample->in_flight += atomic_load_explicit(&c->in_flight, memory_order_relaxed);
+        sample->ports_done += atomic_load_explicit(&c->ports_done, memory_order_relaxed);
+        for (int i = 0; i < 4; i++)
+            sample->results[i] += atomic_load_explicit(&c->results[i], memory_order_relaxed);
+        for (int i = 0; i < 16; i++)
+            sample->icmp_unreach[i] += atomic_load_explicit(&c->icmp_unreach[i],
+                                                            memory_order_relaxed);
+        sample->send_errors += atomic_load_explicit(&c->send_errors, memory_order_relaxed);
+        for (int i = 0; i < SEND_ERRNO_KINDS; i++)
+            sample->send_errno[i] += atomic_load_explicit(&c->send_errno[i], memory_order_relaxed);
+        for (int i = 0; i < SYSCALL_KINDS; i++)
+            sample->syscalls[i] += atomic_load_explicit(&c->syscalls[i], memory_order_relaxed);
+        sample->rxq_drops += atomic_load_explicit(&c->rxq_drops, memory_order_relaxed);
+        sample->rx_truncated += atomic_load_explicit(&c->rx_truncated, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&counters_lock);
+}
+
+/* Histogram bucket of a latency in microseconds */
+static inline unsigned latency_bucket(uint64_t usec) {
+    unsigned shift;
+
+    if (usec < LAT_SUB_BUCKETS)
+        return usec;
+    shift = 63 - __builtin_clzll(usec) - LAT_SUB_BITS;
+    if (shift > LAT_MAX_SHIFT)
+        return LAT_BUCKETS - 1;
+    return ((shift + 1) << LAT_SUB_BITS) + (usec >> shift) - LAT_SUB_BUCKETS;
+}
+
+/* Largest latency that falls into a bucket */
+static uint64_t latency_bucket_high(unsigned bucket) {
+    unsigned shift;
+
+    if (bucket < LAT_SUB_BUCKETS)
+        return bucket;
+    shift = (bucket >> LAT_SUB_BITS) - 1;
+    return ((uint64_t)((bucket & (LAT_SUB_BUCKETS - 1)) + LAT_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+/* Record one response time in the calling thread's histograms; no locking */
+static inline void latency_record(scan_counters_t *c, int probe_id, latency_kind_t kind,
+                                  long usec) {
+    latency_hist_t *h = &c->latency->hist[probe_id][kind];
+
+    if (usec < 0)
+        return;
+    counter_add(&h->buckets[latency_bucket(usec)], 1);
+    counter_add(&h->count, 1);
+    counter_add(&h->sum, usec);
+    if ((uint64_t)usec > counter_get(&h->max))
+        atomic_store_explicit(&h->max, usec, memory_order_relaxed);
+}
+
+/* Add a histogram into one only the calling thread writes */
+static void latency_add(latency_hist_t *into, const latency_hist_t *h) {
+    for (unsigned i = 0; i < LAT_BUCKETS; i++)
+        counter_add(&into->buckets[i], counter_get(&h->buckets[i]));
+    counter_add(&into->count, counter_get(&h->count));
+    counter_add(&into->sum, counter_get(&h->sum));
+    if (counter_get(&h->max) > counter_get(&into->max))
+        atomic_store_explicit(&into->max, counter_get(&h->max), memory_order_relaxed);
+}
+
+/* Snapshot every thread's histograms into merged without stopping them */
+void latency_merge(latency_set_t *merged) {
+    memset(merged, 0, sizeof(*merged));
+    pthread_mutex_lock(&counters_lock);
+    for (scan_counters_t *c = counters_list; c != NULL; c = c->next) {
+        for (int p = 0; p <= PROBE_ID_GENERIC; p++) {
+            for (int k = 0; k < LAT_KINDS; k++)
+                latency_add(&merged->hist[p][k], &c->latency->hist[p][k]);
+        }
+    }
+    pthread_mutex_unlock(&counters_lock);
+}
+
+/*
+ * Sum the histograms of every probe sharing probe p's service into h.
+ * Several probes can share a service (DHCP server/client ports); the
+ * service is reported at its first probe, so later ones return NULL.
+ */
+static const char *latency_service(const latency_set_t *merged, int p, latency_kind_t kind,
+                                   latency_hist_t *h) {
+    const char *service = p < PROBE_ID_GENERIC ? udp_probes[p].service_name : "other";
+
+    for (int q = 0; q < p && q < PROBE_ID_GENERIC; q++) {
+        if (strcmp(udp_probes[q].service_name, service) == 0)
+            return NULL;
+    }
+
+    memset(h, 0, sizeof(*h));
+    latency_add(h, &merged->hist[p][kind]);
+    for (int q = p + 1; q < PROBE_ID_GENERIC; q++) {
+        if (strcmp(udp_probes[q].service_name, service) == 0)
+            latency_add(h, &merged->hist[q][kind]);
+    }
+    return service;
+}
+
+/* Latency at quantile q of a histogram */
+static uint64_t latency_percentile(const latency_hist_t *h, double q) {
+    uint64_t count = counter_get(&h->count);
+    uint64_t max = counter_get(&h->max);
+    uint64_t rank = (uint64_t)(q * count + 0.999999);
+    uint64_t seen = 0;
+
+    if (rank == 0)
+        rank = 1;
+    for (unsigned i = 0; i < LAT_BUCKETS; i++) {
+        seen += counter_get(&h->buckets[i]);
+        if (seen >= rank) {
+            uint64_t high = latency_bucket_high(i);
+            return high < max ? high : max;
+        }
+    }
+    return max;
+}
+
+static void latency_print_row(const char *service, latency_kind_t kind, const latency_hist_t *h) {
+    printf("%-12s %-13s %8llu %8llu %8llu %8llu %8llu %8llu\n",
+           service, latency_kind_names[kind], (unsigned long long)counter_get(&h->count),
+           (unsigned long long)latency_percentile(h, 0.50),
+           (unsigned long long)latency_percentile(h, 0.90),
+           (unsigned long long)latency_percentile(h, 0.99),
+           (unsigned long long)latency_percentile(h, 0.999),
+           (unsigned long long)counter_get(&h->max));
+}
+
+/* Merge every thread's histograms and print percentiles per service */
+void latency_report(void) {
+    static latency_set_t merged;
+    static latency_hist_t total[LAT_KINDS], h;
+
+    latency_merge(&merged);
+    memset(total, 0, sizeof(total));
+
+    for (int k = 0; k < LAT_KINDS; k++) {
+        for (int p = 0; p <= PROBE_ID_GENERIC; p++)
+            latency_add(&total[k], &merged.hist[p][k]);
+    }
+    if (counter_get(&total[LAT_UDP_REPLY].count) + counter_get(&total[LAT_ICMP_ERROR].count) == 0)
+        return;
+
+    printf("\n=== Response Latency (us) ===\n");
+    printf("%-12s %-13s %8s %8s %8s %8s %8s %8s\n",
+           "Service", "Response", "Count", "p50", "p90", "p99", "p99.9", "max");
+    for (int p = 0; p <= PROBE_ID_GENERIC; p++) {
+        for (int k = 0; k < LAT_KINDS; k++) {
+            const char *service = latency_service(&merged, p, k, &h);
+
+            if (service != NULL && counter_get(&h.count) > 0)
+                latency_print_row(service, k, &h);
+        }
+    }
+    for (int k = 0; k < LAT_KINDS; k++) {
+        if (counter_get(&total[k].count) > 0)
+            latency_print_row("all", k, &total[k]);
+    }
+}
+
+/* Print one progress line built from the change since the previous sample */
+static void progress_print(const progress_sample_t *now, const progress_sample_t *prev,
+                           double interval) {
+    char line[256];
+    char eta[32] = "--:--:--";
+    double elapsed = elapsed_usec(&progress.started) / 1000000.0;
+    double done = progress.total_ports ? 100.0 * now->ports_done / progress.total_ports : 100.0;
+    uint64_t sent = now->probes_sent - prev->probes_sent;
+    uint64_t answered = now->responses - prev->responses;
+    int n;
+
+    if (now->ports_done > 0 && elapsed > 0) {
+        long left = (long)((progress.total_ports - now->ports_done) * elapsed / now->ports_done);
+        snprintf(eta, sizeof(eta), "%02ld:%02ld:%02ld", left / 3600, left / 60 % 60, left % 60);
+    }
+
+    n = snprintf(line, sizeof(line),
+                 "%s%llu/%llu ports (%.1f%%) | %.1f pps sent | %.1f resp/s (%.0f%%) | "
+                 "%llu in flight | ETA %s%s",
+                 progress.tty ? "\r\033[K" : "",
+                 (unsigned long long)now->ports_done, (unsigned long long)progress.total_ports,
+                 done, sent / interval, answered / interval,
+                 sent ? 100.0 * answered / sent : 0.0,
+                 (unsigned long long)now->in_flight, eta,
+                 progress.tty ? "" : "\n");
+    if (n < 0)
+        return;
+    if ((size_t)n >= sizeof(line))
+        n = sizeof(line) - 1;
+    /* Progress is best effort; a failed write is not retried */
+    if (write(STDERR_FILENO, line, n) < 0)
+        return;
+}
+
+/* Sample the counters every interval until told to stop */
+static void *progress_thread(void *arg) {
+    progress_sample_t prev, now;
+    struct timespec last, wake;
+
+    (void)arg;
+    counters_sample(&prev);
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    pthread_mutex_lock(&progress.lock);
+    while (!progress.stopping) {
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += progress.interval;
+        pthread_cond_timedwait(&progress.cond, &progress.lock, &wake);
+        if (progress.stopping)
+            break;
+
+        pthread_mutex_unlock(&progress.lock);
+        counters_sample(&now);
+        progress_print(&now, &prev, elapsed_usec(&last) / 1000000.0);
+        clock_gettime(CLOCK_MONOTONIC, &last);
+        prev = now;
+        pthread_mutex_lock(&progress.lock);
+    }
+    pthread_mutex_unlock(&progress.lock);
+    return NULL;
+}
+
+/* Start the reporter when --progress was given */
+void progress_start(uint64_t total_ports) {
+    if (progress.interval <= 0)
+        return;
+
+    progress.tty = isatty(STDERR_FILENO);
+    progress.total_ports = total_ports;
+    clock_gettime(CLOCK_MONOTONIC, &progress.started);
+    if (pthread_create(&progress.thread, NULL, progress_thread, NULL) != 0) {
+        fprintf(stderr, "Warning: Cannot start progress reporter\n");
+        progress.interval = 0;
+    }
+}
+
+/* Stop the reporter and leave the terminal on a fresh line */
+void progress_stop(void) {
+    if (progress.interval <= 0)
+        return;
+
+    pthread_mutex_lock(&progress.lock);
+    progress.stopping = 1;
+    pthread_cond_signal(&progress.cond);
+    pthread_mutex_unlock(&progress.lock);
+    pthread_join(progress.thread, NULL);
+
+    if (progress.tty)
+        fputc('\n', stderr);
+}
+
+/* Read the Udp: line pair of /proc/net/snmp; returns -1 when unavailable */
+int read_udp_snmp(udp_snmp_t *snmp) {
+    char names[512], values[512];
+    FILE *f = fopen("/proc/net/snmp", "r");
+    int found = 0;
+
+    memset(snmp, 0, sizeof(*snmp));
+    if (f == NULL)
+        return -1;
+
+    while (fgets(names, sizeof(names), f) && fgets(values, sizeof(values), f)) {
+        char *np, *vp;
+        char *name, *value;
+
+        if (strncmp(names, "Udp:", 4) != 0)
+            continue;
+        name = strtok_r(names + 4, " \n", &np);
+        value = strtok_r(values + 4, " \n", &vp);
+        while (name != NULL && value != NULL) {
+            uint64_t v = strtoull(value, NULL, 10);
+
+            if (strcmp(name, "InDatagrams") == 0)
+                snmp->in_datagrams = v;
+            else if (strcmp(name, "NoPorts") == 0)
+                snmp->no_ports = v;
+            else if (strcmp(name, "InErrors") == 0)
+                snmp->in_errors = v;
+            else if (strcmp(name, "OutDatagrams") == 0)
+                snmp->out_datagrams = v;
+            else if (strcmp(name, "RcvbufErrors") == 0)
+                snmp->rcvbuf_errors = v;
+            else if (strcmp(name, "SndbufErrors") == 0)
+                snmp->sndbuf_errors = v;
+            name = strtok_r(NULL, " \n", &np);
+            value = strtok_r(NULL, " \n", &vp);
+        }
+        found = 1;
+        break;
+    }
+    fclose(f);
+    return found ? 0 : -1;
+}
+
+/* Write one latency histogram as a Prometheus histogram in seconds */
+static void metrics_histogram(FILE *out, const char *service, latency_kind_t kind,
+                              const latency_hist_t *h) {
+    static const uint64_t bounds_usec[] = {
+        50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+        100000, 250000, 500000, 1000000, 2000000, 5000000
+    };
+    uint64_t cumulative = 0;
+    unsigned bucket = 0;
+
+    for (size_t b = 0; b < sizeof(bounds_usec) / sizeof(bounds_usec[0]); b++) {
+        while (bucket < LAT_BUCKETS && latency_bucket_high(bucket) <= bounds_usec[b])
+            cumulative += counter_get(&h->buckets[bucket++]);
+        fprintf(out, "udp_scanner_response_seconds_bucket{service=\"%s\",response=\"%s\","
+                "le=\"%g\"} %llu\n", service, latency_kind_names[kind],
+                bounds_usec[b] / 1e6, (unsigned long long)cumulative);
+    }
+    fprintf(out, "udp_scanner_response_seconds_bucket{service=\"%s\",response=\"%s\","
+            "le=\"+Inf\"} %llu\n", service, latency_kind_names[kind],
+            (unsigned long long)counter_get(&h->count));
+    fprintf(out, "udp_scanner_response_seconds_sum{service=\"%s\",response=\"%s\"} %g\n",
+            service, latency_kind_names[kind], counter_get(&h->sum) / 1e6);
+    fprintf(out, "udp_scanner_response_seconds_count{service=\"%s\",response=\"%s\"} %llu\n",
+            service, latency_kind_names[kind], (unsigned long long)counter_get(&h->count));
+}
+
+/* Render all metrics in Prometheus text format (version 0.0.4) */
+static void metrics_render(FILE *out) {
+    static const char *const state_labels[4] = { "open", "open_filtered", "closed", "filtered" };
+    static latency_set_t merged;
+    static latency_hist_t h;
+    progress_sample_t now;
+    udp_snmp_t snmp;
+    double interval;
+
+    counters_sample(&now);
+    interval = elapsed_usec(&metrics.last_scrape) / 1000000.0;
+
+    fprintf(out, "# HELP udp_scanner_probes_sent_total UDP probes sent, retries included.\n"
+                 "# TYPE udp_scanner_probes_sent_total counter\n"
+                 "udp_scanner_probes_sent_total %llu\n",
+            (unsigned long long)now.probes_sent);
+    fprintf(out, "# HELP udp_scanner_send_errors_total Probes the kernel refused to send.\n"
+                 "# TYPE udp_scanner_send_errors_total counter\n"
+                 "udp_scanner_send_errors_total %llu\n",
+            (unsigned long long)now.send_errors);
+    fprintf(out, "# HELP udp_scanner_syscalls_total System calls on the probe path.\n"
+                 "# TYPE udp_scanner_syscalls_total counter\n");
+    for (int i = 0; i < SYSCALL_KINDS; i++)
+        fprintf(out, "udp_scanner_syscalls_total{call=\"%s\"} %llu\n",
+                syscall_names[i], (unsigned long long)now.syscalls[i]);
+    fprintf(out, "# HELP udp_scanner_rxq_drops_total Datagrams dropped on the scanner's full "
+                 "receive queues (SO_RXQ_OVFL).\n"
+                 "# TYPE udp_scanner_rxq_drops_total counter\n"
+                 "udp_scanner_rxq_drops_total %llu\n",
+            (unsigned long long)now.rxq_drops);
+    fprintf(out, "# HELP udp_scanner_ports_total Final port results by state.\n"
+                 "# TYPE udp_scanner_ports_total counter\n");
+    for (int i = 0; i < 4; i++)
+        fprintf(out, "udp_scanner_ports_total{state=\"%s\"} %llu\n",
+                state_labels[i], (unsigned long long)now.results[i]);
+    fprintf(out, "# HELP udp_scanner_icmp_total ICMP errors attributed to probes.\n"
+                 "# TYPE udp_scanner_icmp_total counter\n");
+    for (int code = 0; code < 16; code++) {
+        if (now.icmp_unreach[code] > 0)
+            fprintf(out, "udp_scanner_icmp_total{type=\"%d\",code=\"%d\"} %llu\n",
+                    ICMP_UNREACH, code, (unsigned long long)now.icmp_unreach[code]);
+    }
+    fprintf(out, "# HELP udp_scanner_ports_done Ports finished, skipped ones included.\n"
+                 "# TYPE udp_scanner_ports_done gauge\n"
+                 "udp_scanner_ports_done %llu\n"
+                 "# HELP udp_scanner_ports_planned Ports in the scan range.\n"
+                 "# TYPE udp_scanner_ports_planned gauge\n"
+                 "udp_scanner_ports_planned %llu\n",
+            (unsigned long long)now.ports_done, (unsigned long long)metrics.total_ports);
+    fprintf(out, "# HELP udp_scanner_in_flight Probes sent and still awaited.\n"
+                 "# TYPE udp_scanner_in_flight gauge\n"
+                 "udp_scanner_in_flight %llu\n",
+            (unsigned long long)now.in_flight);
+    fprintf(out, "# HELP udp_scanner_probe_rate Probes per second since the previous scrape.\n"
+                 "# TYPE udp_scanner_probe_rate gauge\n"
+                 "udp_scanner_probe_rate %.2f\n",
+            interval > 0 ? (now.probes_sent - metrics.last_sent) / interval : 0.0);
+    metrics.last_sent = now.probes_sent;
+    clock_gettime(CLOCK_MONOTONIC, &metrics.last_scrape);
+
+    if (read_udp_snmp(&snmp) == 0) {
+        fprintf(out, "# HELP udp_scanner_kernel_udp_drops_total Host-wide UDP datagrams the "
+                     "kernel dropped (/proc/net/snmp).\n"
+                     "# TYPE udp_scanner_kernel_udp_drops_total counter\n"
+                     "udp_scanner_kernel_udp_drops_total{reason=\"rcvbuf\"} %llu\n"
+                     "udp_scanner_kernel_udp_drops_total{reason=\"sndbuf\"} %llu\n"
+                     "udp_scanner_kernel_udp_drops_total{reason=\"in_errors\"} %llu\n",
+                (unsigned long long)snmp.rcvbuf_errors,
+                (unsigned long long)snmp.sndbuf_errors,
+                (unsigned long long)snmp.in_errors);
+    }
+
+    latency_merge(&merged);
+    fprintf(out, "# HELP udp_scanner_response_seconds Probe send to response time.\n"
+                 "# TYPE udp_scanner_response_seconds histogram\n");
+    for (int p = 0; p <= PROBE_ID_GENERIC; p++) {
+        for (int k = 0; k < LAT_KINDS; k++) {
+            const char *service = latency_service(&merged, p, k, &h);
+
+            if (service != NULL && counter_get(&h.count) > 0)
+                metrics_histogram(out, service, k, &h);
+        }
+    }
+}
+
+/* Answer one HTTP request; anything but GET /metrics gets a 404 */
+static void metrics_serve(int fd) {
+    char request[1024];
+    char header[256];
+    char *body = NULL;
+    size_t body_len = 0;
+    ssize_t n;
+    FILE *out;
+
+    n = recv(fd, request, sizeof(request) - 1, 0);
+    if (n <= 0)
+        return;
+    request[n] = '\0';
+
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET / ", 6) != 0) {
+        static const char not_found[] =
+            "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send(fd, not_found, sizeof(not_found) - 1, MSG_NOSIGNAL);
+        return;
+    }
+
+    out = open_memstream(&body, &body_len);
+    if (out == NULL)
+        return;
+    metrics_render(out);
+    fclose(out);
+
+    n = snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n", body_len);
+    if (send(fd, header, n, MSG_NOSIGNAL | MSG_MORE) == n)
+        send(fd, body, body_len, MSG_NOSIGNAL);
+    free(body);
+}
+
+/* Accept scrapes one at a time until the scan ends */
+static void *metrics_thread(void *arg) {
+    struct pollfd pfd = { .fd = metrics.listen_fd, .events = POLLIN };
+
+    (void)arg;
+    while (!atomic_load(&metrics.stopping)) {
+        if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+            continue;
+
+        int fd = accept4(metrics.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        /* A stuck client must not hold the endpoint */
+        struct timeval tv = { .tv_sec = 2, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        metrics_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Listen on 127.0.0.1:port when --metrics was given */
+int metrics_start(uint64_t total_ports) {
+    struct sockaddr_in addr;
+    int one = 1;
+
+    if (metrics.port == 0)
+        return 0;
+
+    metrics.total_ports = total_ports;
+    clock_gettime(CLOCK_MONOTONIC, &metrics.last_scrape);
+
+    metrics.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics.listen_fd < 0) {
+        perror("metrics socket");
+        return -1;
+    }
+    setsockopt(metrics.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(metrics.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(metrics.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(metrics.listen_fd, 8) < 0) {
+        fprintf(stderr, "Error: Cannot listen on 127.0.0.1:%d: %s\n", metrics.port, strerror(errno));
+        close(metrics.listen_fd);
+        return -1;
+    }
+
+    if (pthread_create(&metrics.thread, NULL, metrics_thread, NULL) != 0) {
+        fprintf(stderr, "Error: Cannot start metrics thread\n");
+        close(metrics.listen_fd);
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (metrics.port == 0)
+        return;
+
+    atomic_store(&metrics.stopping, 1);
+    pthread_join(metrics.thread, NULL);
+    close(metrics.listen_fd);
+}
+
+static uint64_t clock_ns(clockid_t id) {
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Write every thread's recorder to the dump file; async-signal-safe */
+static void flight_dump(int sig) {
+    scan_flight_header_t h;
+    scan_counters_t *list = __atomic_load_n(&counters_list, __ATOMIC_ACQUIRE);
+    uint64_t mono;
+    int fd;
+
+    fd = open(flight.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCAN_FLIGHT_MAGIC, sizeof(h.magic));
+    h.version = SCAN_FLIGHT_VERSION;
+    h.event_size = sizeof(scan_flight_event_t);
+    h.byte_order = SCAN_LOG_BYTE_ORDER;
+    h.signal = sig;
+    for (scan_counters_t *c = list; c != NULL; c = c->next)
+        h.threads++;
+    h.clock_now = flight_clock();
+    h.realtime_ns = clock_ns(CLOCK_REALTIME);
+    mono = clock_ns(CLOCK_MONOTONIC);
+    h.clock_hz = 1000000000ULL;
+#if defined(__x86_64__) || defined(__i386__)
+    if (mono > flight.mono_start)
+        h.clock_hz = (double)(h.clock_now - flight.clock_start) * 1e9 / (mono - flight.mono_start);
+#endif
+    if (write(fd, &h, sizeof(h)) < 0)
+        goto out;
+
+    for (scan_counters_t *c = list; c != NULL; c = c->next) {
+        const flight_ring_t *r = c->flight;
+        scan_flight_thread_t t;
+        size_t first, tail;
+
+        t.recorded = counter_get(&r->recorded);
+        t.events = t.recorded < FLIGHT_EVENTS ? t.recorded : FLIGHT_EVENTS;
+        t.tid = r->tid;
+        first = (t.recorded - t.events) & (FLIGHT_EVENTS - 1);
+        tail = FLIGHT_EVENTS - first < t.events ? FLIGHT_EVENTS - first : t.events;
+
+        /* Oldest first: from the oldest slot to the end, then from the start */
+        if (write(fd, &t, sizeof(t)) < 0 ||
+            write(fd, &r->events[first], tail * sizeof(r->events[0])) < 0 ||
+            write(fd, r->events, (t.events - tail) * sizeof(r->events[0])) < 0)
+            break;
+    }
+out:
+    close(fd);
+}
+
+static void flight_signal(int sig) {
+    static const char msg[] = "Flight recorder written to ";
+    int saved_errno = errno;
+
+    flight_dump(sig);
+    if (sig != SIGUSR1) {
+        /* SA_RESETHAND restored the default action: die as the signal intended */
+        raise(sig);
+        return;
+    }
+    if (write(STDERR_FILENO, msg, sizeof(msg) - 1) > 0 &&
+        write(STDERR_FILENO, flight.path, strlen(flight.path)) > 0)
+        (void)!write(STDERR_FILENO, "\n", 1);
+    errno = saved_errno;
+}
+
+/* Arm the dump on SIGUSR1 and on fatal signals */
+void flight_start(const char *path) {
+    static const int fatal[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    struct sigaction sa;
+
+    if (path != NULL)
+        snprintf(flight.path, sizeof(flight.path), "%s", path);
+    else
+        snprintf(flight.path, sizeof(flight.path), "udp_scanner-%d.flight", (int)getpid());
+    flight.clock_start = flight_clock();
+    flight.mono_start = clock_ns(CLOCK_MONOTONIC);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = flight_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+    for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++)
+        sigaction(fatal[i], &sa, NULL);
+}
+
+/* Calculate checksum for ICMP/IP */
+unsigned short checksum(void *b, int len) {
+    unsigned short *buf = b;
+    unsigned int sum = 0;
+    unsigned short result;
+
+    for (sum = 0; len > 1; len -= 2)
+        sum += *buf++;
+    if (len == 1)
+        sum += *(unsigned char *)buf;
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum += (sum >> 16);
+    result = ~sum;
+    return result;
+}
+
+/* Give the calling thread its capture ring; NULL when out of memory */
+static pcap_ring_t *capture_ring(void) {
+    pcap_ring_t *r;
+
+    if (thread_ring != NULL)
+        return thread_ring;
+
+    r = aligned_alloc(CACHE_LINE_SIZE, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+    memset(r, 0, sizeof(*r));
+    r->data = malloc(PCAP_RING_SIZE);
+    if (r->data == NULL) {
+        free(r);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&capture.lock);
+    r->next = capture.rings;
+    capture.rings = r;
+    pthread_mutex_unlock(&capture.lock);
+
+    thread_ring = r;
+    return r;
+}
+
+/*
+ * Queue one packet, given as a header and a body, for the capture writer.
+ * Costs the scanning thread two copies and no system call.
+ */
+static void capture_push(const struct timespec *ts, const void *hdr, size_t hdr_len,
+                         const void *body, size_t body_len) {
+    pcap_ring_t *r = capture_ring();
+    size_t len, need, head, tail, off, room;
+    pcap_rec_t rec;
+
+    if (r == NULL)
+        return;
+
+    len = hdr_len + body_len;
+    if (len > PCAP_SNAPLEN) {
+        body_len -= len - PCAP_SNAPLEN;
+        len = PCAP_SNAPLEN;
+    }
+    need = (sizeof(rec) + len + 7) & ~(size_t)7;
+
+    head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    off = head & (PCAP_RING_SIZE - 1);
+    room = PCAP_RING_SIZE - off;
+
+    if (PCAP_RING_SIZE - (head - tail) < need + (room < need ? room : 0)) {
+        counter_add(&r->dropped, 1);
+        return;
+    }
+    if (room < need) {
+        if (room >= sizeof(rec)) {
+            rec.incl_len = PCAP_PAD;
+            memcpy(r->data + off, &rec, sizeof(rec));
+        }
+        head += room;
+        off = 0;
+    }
+
+    rec.ts_sec = ts->tv_sec;
+    rec.ts_nsec = ts->tv_nsec;
+    rec.incl_len = len;
+    rec.orig_len = hdr_len + body_len;
+    memcpy(r->data + off, &rec, sizeof(rec));
+    memcpy(r->data + off + sizeof(rec), hdr, hdr_len);
+    memcpy(r->data + off + sizeof(rec) + hdr_len, body, body_len);
+    atomic_store_explicit(&r->head, head + need, memory_order_release);
+}
+
+/* Kernel timestamp of a packet when there is one, else the wall clock now */
+static void capture_time(const struct timespec *stamp, struct timespec *ts) {
+    if (stamp != NULL && stamp->tv_sec != 0)
+        *ts = *stamp;
+    else
+        clock_gettime(CLOCK_REALTIME, ts);
+}
+
+/*
+ * Capture a UDP datagram our socket sent or received. The kernel built its
+ * IP and UDP headers, so they are reconstructed here: addresses, ports and
+ * lengths are real, TTL, IP ID and the UDP checksum (zero) are not.
+ */
+void capture_udp(const struct timespec *stamp, uint32_t src, uint16_t sport,
+                 uint32_t dst, uint16_t dport, const void *payload, size_t len) {
+    struct {
+        struct ip ip;
+        struct udphdr udp;
+    } __attribute__((packed)) hdr;
+    struct timespec ts;
+
+    if (capture.out == NULL)
+        return;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.ip.ip_v = 4;
+    hdr.ip.ip_hl = sizeof(hdr.ip) >> 2;
+    hdr.ip.ip_len = htons(sizeof(hdr) + len);
+    hdr.ip.ip_ttl = 64;
+    hdr.ip.ip_p = IPPROTO_UDP;
+    hdr.ip.ip_src.s_addr = src;
+    hdr.ip.ip_dst.s_addr = dst;
+    hdr.ip.ip_sum = checksum(&hdr.ip, sizeof(hdr.ip));
+    hdr.udp.source = htons(sport);
+    hdr.udp.dest = htons(dport);
+    hdr.udp.len = htons(sizeof(hdr.udp) + len);
+
+    capture_time(stamp, &ts);
+    capture_push(&ts, &hdr, sizeof(hdr), payload, len);
+}
+
+/* Capture a packet read from the raw ICMP socket, IP header included */
+void capture_ip(const struct timespec *stamp, const void *packet, size_t len) {
+    struct timespec ts;
+
+    if (capture.out == NULL)
+        return;
+    capture_time(stamp, &ts);
+    capture_push(&ts, packet, len, NULL, 0);
+}
+
+/* Learn the source port the kernel picked for a probe socket */
+void capture_set_socket(int sockfd) {
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+
+    if (capture.out == NULL)
+        return;
+    capture_local_port = 0;
+    if (getsockname(sockfd, (struct sockaddr *)&local, &len) == 0)
+        capture_local_port = ntohs(local.sin_port);
+}
+
+/* Write out everything queued in the rings; returns the records written */
+static uint64_t capture_drain(void) {
+    uint64_t records = 0;
+    pcap_ring_t *rings;
+
+    /* Rings are only ever prepended, so the list can be walked unlocked */
+    pthread_mutex_lock(&capture.lock);
+    rings = capture.rings;
+    pthread_mutex_unlock(&capture.lock);
+
+    for (pcap_ring_t *r = rings; r != NULL; r = r->next) {
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        while (tail != head) {
+            size_t off = tail & (PCAP_RING_SIZE - 1);
+            pcap_rec_t rec;
+
+            if (PCAP_RING_SIZE - off < sizeof(rec)) {
+                tail += PCAP_RING_SIZE - off;
+                continue;
+            }
+            memcpy(&rec, r->data + off, sizeof(rec));
+            if (rec.incl_len == PCAP_PAD) {
+                tail += PCAP_RING_SIZE - off;
+                continue;
+            }
+            fwrite(r->data + off, sizeof(rec) + rec.incl_len, 1, capture.out);
+            tail += (sizeof(rec) + rec.incl_len + 7) & ~(size_t)7;
+            records++;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    return records;
+}
+
+static void *capture_thread(void *arg) {
+    const struct timespec nap = { 0, PCAP_DRAIN_NSEC };
+
+    (void)arg;
+    while (!atomic_load(&capture.stopping)) {
+        uint64_t n = capture_drain();
+
+        capture.written += n;
+        if (n == 0)
+            nanosleep(&nap, NULL);
+    }
+    capture.written += capture_drain();
+    return NULL;
+}
+
+/* Create the pcap file and start its writer; no-op without --pcap */
+int capture_open(const char *path, struct in_addr target) {
+    static const struct {
+        uint32_t magic;
+        uint16_t version_major;
+        uint16_t version_minor;
+        int32_t thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t linktype;
+    } header = { 0xa1b23c4d, 2, 4, 0, 0, PCAP_SNAPLEN, PCAP_LINKTYPE_RAW };
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    FILE *out;
+    int fd;
+
+    if (path == NULL)
+        return 0;
+
+    /* Connecting a UDP socket picks the route, and so our source address */
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(9);
+    addr.sin_addr = target;
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        getsockname(fd, (struct sockaddr *)&addr, &len) == 0)
+        capture.local_addr = addr.sin_addr;
+    if (fd >= 0)
+        close(fd);
+
+    out = fopen(path, "wbe");
+    if (out == NULL) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    setvbuf(out, NULL, _IOFBF, OUTPUT_CHUNK_SIZE);
+    fwrite(&header, sizeof(header), 1, out);
+
+    capture.path = path;
+    capture.out = out;
+    if (pthread_create(&capture.thread, NULL, capture_thread, NULL) != 0) {
+        fprintf(stderr, "Error: Cannot start capture thread\n");
+        capture.out = NULL;
+        fclose(out);
+        return -1;
+    }
+    return 0;
+}
+
+/* Stop the writer once every queued packet is out, and report drops */
+void capture_close(void) {
+    uint64_t dropped = 0;
+    FILE *out = capture.out;
+
+    if (out == NULL)
+        return;
+
+    atomic_store(&capture.stopping, 1);
+    pthread_join(capture.thread, NULL);
+    capture.out = NULL;
+
+    for (pcap_ring_t *r = capture.rings; r != NULL; r = r->next)
+        dropped += counter_get(&r->dropped);
+    if (fclose(out) != 0)
+        fprintf(stderr, "Error: Writing %s failed: %s\n", capture.path, strerror(errno));
+    printf("Captured %llu packets to %s", (unsigned long long)capture.written, capture.path);
+    if (dropped > 0)
+        printf(" (%llu dropped: capture ring full)", (unsigned long long)dropped);
+    printf("\n");
+}
+
+/* Send UDP probe packet */
+int send_udp_probe(int sockfd, const char *target_ip, int port, 
+                   const unsigned char *payload, size_t payload_len) {
+    struct sockaddr_in dest;
+    int ret;
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(port);
+    dest.sin_addr.s_addr = inet_addr(target_ip);
+
+    if (payload_len > 0) {
+        ret = sendto(sockfd, payload, payload_len, 0,
+                    (struct sockaddr *)&dest, sizeof(dest));
+    } else {
+        /* Send empty UDP packet */
+        ret = sendto(sockfd, "", 0, 0,
+                    (struct sockaddr *)&dest, sizeof(dest));
+    }
+
+    count_syscalls(SYSCALL_SENDTO, 1);
+    if (ret < 0) {
+        int err = errno;
+        send_errno_t kind = err == ENOBUFS ? SEND_ENOBUFS :
+                            err == EPERM ? SEND_EPERM :
+                            err == ECONNREFUSED ? SEND_ECONNREFUSED : SEND_OTHER;
+
+        if (thread_counters != NULL)
+            counter_add(&thread_counters->send_errno[kind], 1);
+        perror("sendto");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Ask for kernel timestamps on a socket. Software stamps are always
+ * available; hardware stamps appear only where the NIC has been configured
+ * for them (SIOCSHWTSTAMP). With tx set, every sent datagram also queues
+ * its TX stamp on the socket's error queue. Failure leaves the userspace
+ * clock as the RTT source.
+ */
+void enable_timestamping(int sockfd, int tx) {
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+                SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+
+    if (tx)
+        flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE |
+                 SOF_TIMESTAMPING_OPT_TSONLY;
+    setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    count_syscalls(SYSCALL_SOCKET, 1);
+}
+
+/* Pull the software and hardware stamps out of a message's control data */
+static void cmsg_timestamps(struct msghdr *msg, struct timespec *sw, struct timespec *hw) {
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+            const struct scm_timestamping *ts = (const void *)CMSG_DATA(cm);
+            if (ts->ts[0].tv_sec != 0)
+                *sw = ts->ts[0];
+            if (ts->ts[2].tv_sec != 0)
+                *hw = ts->ts[2];
+        }
+    }
+}
+
+/* Drain the error queue, keeping the newest TX stamps of the last probe */
+void read_tx_timestamp(int sockfd, probe_timing_t *timing) {
+    char control[256];
+    struct msghdr msg;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        count_syscalls(SYSCALL_ERRQUEUE, 1);
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+        cmsg_timestamps(&msg, &timing->tx, &timing->tx_hw);
+    }
+}
+
+/* Next receive slot of the calling thread's pool */
+static unsigned char *rx_buffer(void) {
+    rx_pool_t *pool = thread_rx_pool;
+
+    if (pool == NULL) {
+        pool = aligned_alloc(CACHE_LINE_SIZE, sizeof(*pool));
+        if (pool == NULL) {
+            perror("receive buffers");
+            exit(1);
+        }
+        pool->next = 0;
+        thread_rx_pool = pool;
+    }
+    return pool->slot[pool->next++ & (RX_POOL_BUFFERS - 1)];
+}
+
+/*
+ * Size a table for rate_pps probes a second, each awaited at most
+ * timeout_usec: their product bounds the probes in flight, and the table
+ * keeps a quarter of its slots free beyond that.
+ */
+int inflight_init(inflight_table_t *t, uint64_t rate_pps, long timeout_usec) {
+    uint64_t bound = rate_pps * (uint64_t)timeout_usec / 1000000 + 1;
+    uint64_t slots = INFLIGHT_MIN_SLOTS;
+    unsigned bits = __builtin_ctz(INFLIGHT_MIN_SLOTS);
+
+    while (slots < bound + bound / 3) {
+        slots <<= 1;
+        bits++;
+    }
+    if (slots > (1ULL << 31))
+        return -1;
+    t->slots = table_alloc("in-flight", slots * sizeof(*t->slots), &t->mapped);
+    if (t->slots == NULL)
+        return -1;
+    t->mask = slots - 1;
+    t->count = 0;
+    t->limit = slots - slots / 8;
+    t->shift = 64 - bits;
+    return 0;
+}
+
+void inflight_free(inflight_table_t *t) {
+    munmap(t->slots, t->mapped);
+    t->slots = NULL;
+}
+
+/* Home slot of a key: Fibonacci hashing keeps the top bits of the product */
+static inline uint32_t inflight_home(const inflight_table_t *t, uint32_t addr, int port,
+                                     int probe_id) {
+    uint64_t key = (uint64_t)addr << 32 | (uint32_t)port << 16 | (uint16_t)probe_id;
+
+    return (key * 0x9E3779B97F4A7C15ULL) >> t->shift;
+}
+
+inflight_entry_t *inflight_find(inflight_table_t *t, uint32_t addr, int port, int probe_id) {
+    for (uint32_t i = inflight_home(t, addr, port, probe_id);; i = (i + 1) & t->mask) {
+        inflight_entry_t *e = &t->slots[i];
+
+        if (e->port == 0)
+            return NULL;
+        if (e->addr == addr && e->port == port && e->probe_id == probe_id)
+            return e;
+    }
+}
+
+/*
+ * Entry for a probe, added with its other fields zeroed unless already
+ * there. Returns NULL once the table holds limit entries, which the sizing
+ * leaves out of reach at the configured rate. Entries move on removal, so
+ * a pointer is good only until the next remove.
+ */
+inflight_entry_t *inflight_insert(inflight_table_t *t, uint32_t addr, int port, int probe_id) {
+    for (uint32_t i = inflight_home(t, addr, port, probe_id);; i = (i + 1) & t->mask) {
+        inflight_entry_t *e = &t->slots[i];
+
+        if (e->port == 0) {
+            if (t->count >= t->limit)
+                return NULL;
+            memset(e, 0, sizeof(*e));
+            e->addr = addr;
+            e->port = port;
+            e->probe_id = probe_id;
+            t->count++;
+            return e;
+        }
+        if (e->addr == addr && e->port == port && e->probe_id == probe_id)
+            return e;
+    }
+}
+
+/*
+ * Remove an entry by backward shift: each later entry of the cluster moves
+ * into the hole unless its home slot lies after the hole, then the hole
+ * moves on to where it was. The cluster ends at the first free slot.
+ */
+void inflight_remove(inflight_table_t *t, inflight_entry_t *e) {
+    uint32_t hole = e - t->slots;
+
+    for (uint32_t i = (hole + 1) & t->mask; t->slots[i].port != 0; i = (i + 1) & t->mask) {
+        const inflight_entry_t *m = &t->slots[i];
+        uint32_t home = inflight_home(t, m->addr, m->port, m->probe_id);
+
+        if (((i - home) & t->mask) >= ((i - hole) & t->mask)) {
+            t->slots[hole] = *m;
+            hole = i;
+        }
+    }
+    t->slots[hole].port = 0;
+    t->count--;
+}
+
+/* The calling thread's table, sized for the probe rate and the longest timeout */
+static inflight_table_t *inflight_table(void) {
+    inflight_table_t *t = thread_inflight;
+
+    if (t == NULL) {
+        t = malloc(sizeof(*t));
+        if (t == NULL || inflight_init(t, 1000000 / PROBE_INTERVAL_USEC,
+                                       TIMEOUT_SEC * 1000000L + TIMEOUT_USEC) < 0) {
+            perror("in-flight table");
+            exit(1);
+        }
+        thread_inflight = t;
+    }
+    return t;
+}
+
+static int probe_id_for_port(int port) {
+    udp_probe_t *probe = get_probe_for_port(port);
+
+    return probe != NULL ? (int)(probe - udp_probes) : PROBE_ID_GENERIC;
+}
+
+/*
+ * Non-blocking receive that also returns the datagram's RX stamps and the
+ * socket's SO_RXQ_OVFL count: datagrams the kernel has dropped so far
+ * because the receive queue was full. Returns the datagram's full length
+ * (MSG_TRUNC), which exceeds len when only its first len bytes were stored.
+ * The sender's address goes to from unless it is NULL.
+ */
+static ssize_t recv_timestamped(int sockfd, unsigned char *buf, size_t len,
+                                struct timespec *rx, struct timespec *rx_hw,
+                                uint32_t *rxq_drops, struct sockaddr_in *from) {
+    char control[256];
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (from != NULL) {
+        memset(from, 0, sizeof(*from));
+        msg.msg_name = from;
+        msg.msg_namelen = sizeof(*from);
+    }
+
+    memset(rx, 0, sizeof(*rx));
+    memset(rx_hw, 0, sizeof(*rx_hw));
+    n = recvmsg(sockfd, &msg, MSG_DONTWAIT | MSG_TRUNC);
+    count_syscalls(SYSCALL_RECVMSG, 1);
+    if ((msg.msg_flags & MSG_TRUNC) && thread_counters != NULL)
+        counter_add(&thread_counters->rx_truncated, 1);
+    if (n > 0) {
+        cmsg_timestamps(&msg, rx, rx_hw);
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL)
+                memcpy(rxq_drops, CMSG_DATA(cm), sizeof(*rxq_drops));
+        }
+    }
+    return n;
+}
+
+static long timespec_diff_usec(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/*
+ * Set the RTT of a result from the best matching pair of stamps: NIC TX and
+ * RX, else kernel TX and RX, else the userspace clock around the wait.
+ */
+static void set_rtt(scan_result_t *result, const probe_timing_t *timing,
+                    const struct timespec *rx, const struct timespec *rx_hw) {
+    long rtt;
+
+    if (timing->tx_hw.tv_sec != 0 && rx_hw->tv_sec != 0) {
+        rtt = timespec_diff_usec(&timing->tx_hw, rx_hw);
+        if (rtt >= 0) {
+            result->rtt_usec = rtt;
+            result->rtt_source = RTT_SOURCE_HW;
+            return;
+        }
+    }
+    if (timing->tx.tv_sec != 0 && rx->tv_sec != 0) {
+        rtt = timespec_diff_usec(&timing->tx, rx);
+        if (rtt >= 0) {
+            result->rtt_usec = rtt;
+            result->rtt_source = RTT_SOURCE_KERNEL;
+            return;
+        }
+    }
+    result->rtt_usec = elapsed_usec(&timing->sent);
+    result->rtt_source = RTT_SOURCE_USER;
+}
+
+/* Fold one RTT sample into the target's estimate (RFC 6298, usec) */
+void host_rtt_update(long rtt_usec, rtt_source_t source) {
+    if (host_rtt.samples == 0) {
+        host_rtt.srtt_usec = rtt_usec;
+        host_rtt.rttvar_usec = rtt_usec / 2;
+    } else {
+        long err = rtt_usec - host_rtt.srtt_usec;
+        host_rtt.rttvar_usec += ((err < 0 ? -err : err) - host_rtt.rttvar_usec) / 4;
+        host_rtt.srtt_usec += err / 8;
+    }
+    host_rtt.samples++;
+    if (source != RTT_SOURCE_USER)
+        host_rtt.kernel_samples++;
+}
+
+/* Probe timeout for the target: SRTT + 4 * RTTVAR within fixed bounds */
+long host_timeout_usec(void) {
+    long max = TIMEOUT_SEC * 1000000L + TIMEOUT_USEC;
+    long timeout;
+
+    if (host_rtt.samples == 0)
+        return max;
+
+    timeout = host_rtt.srtt_usec + 4 * host_rtt.rttvar_usec;
+    if (timeout < HOST_TIMEOUT_MIN_USEC)
+        timeout = HOST_TIMEOUT_MIN_USEC;
+    return timeout < max ? timeout : max;
+}
+
+/*
+ * Classify a packet read from the raw ICMP socket (IP header included).
+ * Destination unreachable decides the port: closed for code 3, filtered
+ * for any other code, with type and code stored in the result. Returns -1
+ * for anything else, including truncated packets.
+ */
+int classify_icmp(const unsigned char *packet, size_t len, scan_result_t *result) {
+    const struct ip *ip_hdr = (const struct ip *)packet;
+    const struct icmp *icmp_hdr;
+    size_t hlen;
+
+    if (len < sizeof(struct ip))
+        return -1;
+    hlen = ip_hdr->ip_hl << 2;
+    if (hlen < sizeof(struct ip) || len < hlen + ICMP_MINLEN)
+        return -1;
+
+    icmp_hdr = (const struct icmp *)(packet + hlen);
+    if (icmp_hdr->icmp_type != ICMP_UNREACH)
+        return -1;
+
+    result->icmp_type = icmp_hdr->icmp_type;
+    result->icmp_code = icmp_hdr->icmp_code;
+    return icmp_hdr->icmp_code == ICMP_UNREACH_PORT ? PORT_CLOSED : PORT_FILTERED;
+}
+
+/*
+ * Find the UDP datagram an ICMP error quotes (its IP header and first 8
+ * bytes). Returns 0 and the datagram's source and destination addresses
+ * and ports when the packet carries one, -2 when it quotes a packet of
+ * another protocol and -1 when there is no quote to parse.
+ */
+int icmp_quoted_udp(const unsigned char *packet, size_t len, uint32_t *src,
+                    uint32_t *dst, uint16_t *sport, uint16_t *dport) {
+    const struct ip *inner;
+    const struct udphdr *udp;
+    size_t hlen, inner_hlen;
+
+    if (len < sizeof(struct ip))
+        return -1;
+    hlen = ((const struct ip *)packet)->ip_hl << 2;
+    if (hlen < sizeof(struct ip) || len < hlen + ICMP_MINLEN + sizeof(struct ip))
+        return -1;
+
+    inner = (const struct ip *)(packet + hlen + ICMP_MINLEN);
+    inner_hlen = inner->ip_hl << 2;
+    if (inner_hlen < sizeof(struct ip) || len < hlen + ICMP_MINLEN + inner_hlen)
+        return -1;
+    if (inner->ip_p != IPPROTO_UDP)
+        return -2;
+    if (len < hlen + ICMP_MINLEN + inner_hlen + sizeof(struct udphdr))
+        return -1;
+
+    udp = (const struct udphdr *)((const unsigned char *)inner + inner_hlen);
+    *src = inner->ip_src.s_addr;
+    *dst = inner->ip_dst.s_addr;
+    *sport = ntohs(udp->source);
+    *dport = ntohs(udp->dest);
+    return 0;
+}
+
+/*
+ * Receive and analyze responses until one decides the port or time runs
+ * out. rxq_drops holds the SO_RXQ_OVFL counts of the UDP and ICMP sockets.
+ */
+int receive_response(int udp_sock, int icmp_sock, scan_result_t *result,
+                     probe_timing_t *timing, long timeout_usec, uint32_t rxq_drops[2]) {
+    unsigned char *buffer;
+    struct timespec rx, rx_hw;
+    fd_set readfds;
+    struct timeval tv;
+    long remaining;
+    int ret;
+    int maxfd;
+
+    maxfd = (udp_sock > icmp_sock) ? udp_sock : icmp_sock;
+
+    for (;;) {
+        remaining = timeout_usec - elapsed_usec(&timing->sent);
+        if (remaining <= 0) {
+            /* Timeout - port is likely open|filtered */
+            return PORT_OPEN_FILTERED;
+        }
+
+        FD_ZERO(&readfds);
+        FD_SET(udp_sock, &readfds);
+        FD_SET(icmp_sock, &readfds);
+        tv.tv_sec = remaining / 1000000;
+        tv.tv_usec = remaining % 1000000;
+
+        ret = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+        count_syscalls(SYSCALL_SELECT, 1);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("select");
+            return -1;
+        } else if (ret == 0) {
+            return PORT_OPEN_FILTERED;
+        }
+
+        /* Check UDP socket for service response; a queued TX stamp also wakes it */
+        if (FD_ISSET(udp_sock, &readfds)) {
+            read_tx_timestamp(udp_sock, timing);
+            buffer = rx_buffer();
+            struct sockaddr_in from;
+            ssize_t n = recv_timestamped(udp_sock, buffer, RX_BUF_SIZE, &rx, &rx_hw,
+                                         &rxq_drops[0], &from);
+            if (n > 0) {
+                capture_udp(&rx, from.sin_addr.s_addr, ntohs(from.sin_port),
+                            capture.local_addr.s_addr, capture_local_port, buffer,
+                            n < RX_BUF_SIZE ? (size_t)n : RX_BUF_SIZE);
+                set_rtt(result, timing, &rx, &rx_hw);
+                result->bytes = n;
+                result->banner = banner_copy(&thread_arena, buffer,
+                                             n < RX_BUF_SIZE ? (size_t)n : RX_BUF_SIZE);
+                return PORT_OPEN;
+            }
+        }
+
+        /* Check ICMP socket for port unreachable */
+        if (FD_ISSET(icmp_sock, &readfds)) {
+            buffer = rx_buffer();
+            ssize_t n = recv_timestamped(icmp_sock, buffer, RX_BUF_SIZE, &rx, &rx_hw,
+                                         &rxq_drops[1], NULL);
+            if (n > 0) {
+                size_t len = n < RX_BUF_SIZE ? (size_t)n : RX_BUF_SIZE;
+                uint32_t src, dst;
+                uint16_t sport, dport;
+                int state, quoted;
+
+                capture_ip(&rx, buffer, len);
+                /* Errors quoting another protocol's packet, or a probe nobody
+                 * awaits such as a late answer for an earlier port, say
+                 * nothing about this one */
+                quoted = icmp_quoted_udp(buffer, len, &src, &dst, &sport, &dport);
+                if (quoted == -2 ||
+                    (quoted == 0 &&
+                     inflight_find(inflight_table(), dst, dport, probe_id_for_port(dport)) == NULL))
+                    continue;
+                state = classify_icmp(buffer, len, result);
+                if (state >= 0) {
+                    read_tx_timestamp(udp_sock, timing);
+                    set_rtt(result, timing, &rx, &rx_hw);
+                    return state;
+                }
+            }
+        }
+    }
+}
+
+/* Scan single UDP port */
+void scan_udp_port(const char *target_ip, int port) {
+    int udp_sock, icmp_sock;
+    udp_probe_t *probe;
+    const unsigned char *payload;
+    size_t payload_len;
+    scan_result_t result;
+    probe_timing_t timing;
+    long first_timeout_usec, timeout_usec;
+    uint32_t rxq_drops[2] = { 0, 0 };
+    int one = 1;
+    int state = -1;
+    scan_counters_t *counters = counters_register();
+    inflight_table_t *inflight = inflight_table();
+    inflight_entry_t *pending;
+    probe_plan_t plan;
+
+    /* Create UDP socket */
+    udp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (udp_sock < 0) {
+        perror("UDP socket creation failed");
+        return;
+    }
+
+    /* Create raw socket for ICMP */
+    icmp_sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+    if (icmp_sock < 0) {
+        perror("ICMP socket creation failed (need root)");
+        close(udp_sock);
+        return;
+    }
+
+    count_syscalls(SYSCALL_SOCKET, 2);
+
+    enable_timestamping(udp_sock, 1);
+    enable_timestamping(icmp_sock, 0);
+
+    /* Have receives report datagrams dropped on a full receive queue */
+    setsockopt(udp_sock, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+    setsockopt(icmp_sock, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+    count_syscalls(SYSCALL_SOCKET, 2);
+
+    memset(&result, 0, sizeof(result));
+    result.target.s_addr = inet_addr(target_ip);
+    result.port = port;
+    result.rtt_usec = -1;
+    result.icmp_type = -1;
+    result.icmp_code = -1;
+
+    /* Get protocol-specific probe */
+    probe = get_probe_for_port(port);
+    if (probe) {
+        payload = probe->payload;
+        payload_len = probe->payload_len;
+        result.service_name = probe->service_name;
+        result.probe_name = probe->probe_name;
+        result.probe_id = probe - udp_probes;
+    } else {
+        payload = empty_probe;
+        payload_len = 0;
+        result.probe_name = "empty";
+        result.probe_id = PROBE_ID_GENERIC;
+    }
+
+    /* Ports open in the baseline get one short probe instead of the full budget */
+    plan = baseline_plan(port, &first_timeout_usec);
+
+    /* Send probe with retries */
+    for (int i = 0; i < MAX_RETRIES; i++) {
+        /*
+         * Each retry doubles the RTT-derived timeout, up to the fixed maximum.
+         * The last one always waits the maximum: a slow service (a recursive
+         * DNS lookup, a loaded SNMP agent) answers well after the target's
+         * ICMP round trip.
+         */
+        timeout_usec = host_timeout_usec() << i;
+        if (i == MAX_RETRIES - 1 || timeout_usec > TIMEOUT_SEC * 1000000L + TIMEOUT_USEC)
+            timeout_usec = TIMEOUT_SEC * 1000000L + TIMEOUT_USEC;
+        if (i == 0 && first_timeout_usec < timeout_usec)
+            timeout_usec = first_timeout_usec;
+
+        if (i > 0)
+            SCAN_TRACE(retry, result.target.s_addr, port, result.probe_id, i);
+
+        /* Stale stamps of an earlier attempt must not time this one */
+        read_tx_timestamp(udp_sock, &timing);
+        memset(&timing, 0, sizeof(timing));
+        clock_gettime(CLOCK_MONOTONIC, &timing.sent);
+        if (send_udp_probe(udp_sock, target_ip, port, payload, payload_len) < 0) {
+            flight_record(SCAN_EV_SEND_ERROR, result.target.s_addr, port, result.probe_id, i, errno);
+            counter_add(&counters->send_errors, 1);
+            counter_add(&counters->rxq_drops, rxq_drops[0] + rxq_drops[1]);
+            close(udp_sock);
+            close(icmp_sock);
+            count_syscalls(SYSCALL_SOCKET, 2);
+            return;
+        }
+        read_tx_timestamp(udp_sock, &timing);
+        SCAN_TRACE(probe__sent, result.target.s_addr, port, result.probe_id, i);
+        flight_record(SCAN_EV_SEND, result.target.s_addr, port, result.probe_id, i, timeout_usec);
+        if (i == 0)
+            capture_set_socket(udp_sock);
+        capture_udp(&timing.tx, capture.local_addr.s_addr, capture_local_port,
+                    result.target.s_addr, port, payload, payload_len);
+        counter_add(&counters->probes_sent, 1);
+        counter_add(&counters->in_flight, 1);
+        pending = inflight_insert(inflight, result.target.s_addr, port, result.probe_id);
+        if (pending != NULL) {
+            pending->sent_usec = timing.sent.tv_sec * 1000000ULL + timing.sent.tv_nsec / 1000;
+            pending->timeout_ms = timeout_usec / 1000;
+            pending->attempt = i;
+        }
+
+        /* Wait for response */
+        int ret = receive_response(udp_sock, icmp_sock, &result, &timing, timeout_usec,
+                                   rxq_drops);
+        counter_add(&counters->in_flight, -1);
+        pending = inflight_find(inflight, result.target.s_addr, port, result.probe_id);
+        if (pending != NULL)
+            inflight_remove(inflight, pending);
+        if (ret == PORT_OPEN) {
+            SCAN_TRACE(udp__response, result.target.s_addr, port, result.probe_id,
+                       result.rtt_usec);
+            flight_record(SCAN_EV_UDP_REPLY, result.target.s_addr, port, result.probe_id,
+                          0, result.rtt_usec);
+        } else if (ret == PORT_CLOSED || ret == PORT_FILTERED) {
+            SCAN_TRACE(icmp__error, result.target.s_addr, port, result.probe_id,
+                       result.icmp_code);
+            flight_record(SCAN_EV_ICMP, result.target.s_addr, port, result.probe_id,
+                          result.icmp_code, result.rtt_usec);
+        } else if (ret == PORT_OPEN_FILTERED) {
+            SCAN_TRACE(timeout, result.target.s_addr, port, result.probe_id, timeout_usec);
+            flight_record(SCAN_EV_TIMEOUT, result.target.s_addr, port, result.probe_id,
+                          i, timeout_usec);
+        }
+        /* A later timeout must not undo an ICMP answer the result still carries */
+        if (ret >= 0 && !(ret == PORT_OPEN_FILTERED && state == PORT_FILTERED)) {
+            state = ret;
+        }
+        if (ret >= 0 && ret != PORT_OPEN_FILTERED) {
+            long rto = host_timeout_usec();
+
+            counter_add(&counters->responses, 1);
+            host_rtt_update(result.rtt_usec, result.rtt_source);
+            if (host_timeout_usec() != rto)
+                flight_record(SCAN_EV_RTO, result.target.s_addr, port, result.probe_id,
+                              0, host_timeout_usec());
+            latency_record(counters, result.probe_id,
+                           ret == PORT_OPEN ? LAT_UDP_REPLY : LAT_ICMP_ERROR,
+                           result.rtt_usec);
+        }
+        
+        /* If we got definitive answer (open or closed), stop retrying */
+        if (ret == PORT_OPEN || ret == PORT_CLOSED) {
+            break;
+        }
+        if (plan == PLAN_FAST) {
+            break;
+        }
+    }
+
+    /* Nothing attributable to our probe arrived on any attempt */
+    result.state = (state >= 0) ? (port_state_t)state : PORT_OPEN_FILTERED;
+    flight_record(SCAN_EV_RESULT, result.target.s_addr, port, result.probe_id,
+                  result.state, result.rtt_usec);
+    counter_add(&counters->results[result.state], 1);
+    if (result.icmp_type == ICMP_UNREACH)
+        counter_add(&counters->icmp_unreach[result.icmp_code & 15], 1);
+    port_store_set(&store, &result);
+    report_result(&result);
+    /* Every sink has formatted the result into its chunk */
+    arena_release(&thread_arena);
+
+    counter_add(&counters->rxq_drops, rxq_drops[0] + rxq_drops[1]);
+    close(udp_sock);
+    close(icmp_sock);
+    count_syscalls(SYSCALL_SOCKET, 2);
+}
+
+/* Offset of the IPv4 header in a captured frame; -1 when it holds none */
+static long replay_link_offset(uint32_t linktype, const unsigned char *frame, size_t len) {
+    switch (linktype) {
+    case 101:                   /* LINKTYPE_RAW */
+    case 228:                   /* LINKTYPE_IPV4 */
+        return 0;
+    case 1:                     /* LINKTYPE_ETHERNET */
+        return len >= 14 && frame[12] == 0x08 && frame[13] == 0x00 ? 14 : -1;
+    case 113:                   /* LINKTYPE_LINUX_SLL */
+        return len >= 16 && frame[14] == 0x08 && frame[15] == 0x00 ? 16 : -1;
+    case 276:                   /* LINKTYPE_LINUX_SLL2 */
+        return len >= 20 && frame[0] == 0x08 && frame[1] == 0x00 ? 20 : -1;
+    default:
+        return -1;
+    }
+}
+
+/* Port table of a target; creates it on a probe, NULL for unknown replies */
+static replay_port_t *replay_ports(replay_target_t **targets, uint32_t addr, int create) {
+    replay_target_t **tail = targets;
+
+    for (replay_target_t *t = *targets; t != NULL; t = t->next) {
+        if (t->addr.s_addr == addr)
+            return t->ports;
+        tail = &t->next;
+    }
+    if (!create)
+        return NULL;
+
+    replay_target_t *t = calloc(1, sizeof(*t));
+    if (t == NULL || (t->ports = calloc(65536, sizeof(*t->ports))) == NULL) {
+        perror("replay");
+        exit(1);
+    }
+    t->addr.s_addr = addr;
+    *tail = t;
+    return t->ports;
+}
+
+/* A pcap header field: records follow arbitrary caplens, so never aligned */
+static uint32_t replay_u32(const unsigned char *p, int swapped) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return swapped ? __builtin_bswap32(v) : v;
+}
+
+/* Apply an answer unless an earlier one already decided the port */
+static int replay_answer(replay_port_t *p, int state, uint64_t nsec) {
+    if (p->sent_nsec == 0 || p->state == PORT_OPEN || p->state == PORT_CLOSED)
+        return 0;
+    p->state = state;
+    p->rtt_usec = nsec > p->sent_nsec ? (nsec - p->sent_nsec) / 1000 : 0;
+    return 1;
+}
+
+/*
+ * Offline replay (--replay): classify a pcap through the same code the
+ * live receive path uses, without touching the network. The scanning host
+ * is the source of the first UDP datagram in the capture; its UDP packets
+ * are probes, UDP packets back to it from a probed port open that port and
+ * ICMP unreachables quoting a probe close or filter it. Ports probed
+ * without an answer are open|filtered. Results go to the configured
+ * outputs, named with the current probe table, with a banner from each
+ * reply's payload as a live scan would report it.
+ */
+int replay_pcap(const char *path) {
+    static unsigned char aligned[RX_BUF_SIZE] __attribute__((aligned(8)));
+    const unsigned char *map, *end, *rec;
+    replay_target_t *targets = NULL;
+    uint64_t packets = 0, probes = 0, answers = 0;
+    uint32_t magic, linktype, local = 0;
+    struct timespec started;
+    int swapped, nsec;
+    struct stat st;
+    double elapsed;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (st.st_size < 24) {
+        fprintf(stderr, "Error: %s: not a pcap file\n", path);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+    memcpy(&magic, map, sizeof(magic));
+    switch (magic) {
+    case 0xa1b2c3d4: swapped = 0; nsec = 0; break;
+    case 0xa1b23c4d: swapped = 0; nsec = 1; break;
+    case 0xd4c3b2a1: swapped = 1; nsec = 0; break;
+    case 0x4d3cb2a1: swapped = 1; nsec = 1; break;
+    default:
+        fprintf(stderr, "Error: %s: not a pcap file\n", path);
+        munmap((void *)map, st.st_size);
+        return -1;
+    }
+    linktype = replay_u32(map + 20, swapped) & 0xFFFF;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    end = map + st.st_size;
+    for (rec = map + 24; rec + 16 <= end; ) {
+        uint32_t caplen = replay_u32(rec + 8, swapped);
+        const unsigned char *frame = rec + 16;
+        uint64_t ts = replay_u32(rec, swapped) * 1000000000ULL +
+                      replay_u32(rec + 4, swapped) * (nsec ? 1ULL : 1000ULL);
+        const struct ip *ip;
+        replay_port_t *ports;
+        long l3;
+        size_t len, hlen;
+
+        if ((size_t)(end - frame) < caplen)
+            break;
+        rec = frame + caplen;
+        packets++;
+
+        l3 = replay_link_offset(linktype, frame, caplen);
+        if (l3 < 0 || caplen - (size_t)l3 < sizeof(struct ip))
+            continue;
+        len = caplen - l3;
+        /* Parse headers from an aligned copy unless the frame already is */
+        if (((uintptr_t)(frame + l3) & 3) != 0) {
+            if (len > sizeof(aligned))
+                len = sizeof(aligned);
+            memcpy(aligned, frame + l3, len);
+            ip = (const struct ip *)aligned;
+        } else {
+            ip = (const struct ip *)(frame + l3);
+        }
+        hlen = ip->ip_hl << 2;
+        if (ip->ip_v != 4 || hlen < sizeof(struct ip) || len < hlen)
+            continue;
+
+        if (ip->ip_p == IPPROTO_UDP && len >= hlen + sizeof(struct udphdr)) {
+            const struct udphdr *udp = (const struct udphdr *)((const unsigned char *)ip + hlen);
+            replay_port_t *p = NULL;
+
+            if (local == 0)
+                local = ip->ip_src.s_addr;
+
+            /* A reply comes from a probed port back to the probe's source port */
+            if (ip->ip_dst.s_addr == local &&
+                (ports = replay_ports(&targets, ip->ip_src.s_addr, 0)) != NULL)
+                p = &ports[ntohs(udp->source)];
+            if (p != NULL && p->sent_nsec != 0 && p->sport == ntohs(udp->dest)) {
+                if (replay_answer(p, PORT_OPEN, ts)) {
+                    size_t data = hlen + sizeof(struct udphdr);
+
+                    p->bytes = ntohs(udp->len) - sizeof(struct udphdr);
+                    p->payload_off = frame + l3 + data - map;
+                    p->payload_len = caplen - l3 - data;
+                    if ((int64_t)p->payload_len > p->bytes)
+                        p->payload_len = p->bytes > 0 ? p->bytes : 0;
+                    answers++;
+                }
+            } else if (ip->ip_src.s_addr == local) {
+                p = &replay_ports(&targets, ip->ip_dst.s_addr, 1)[ntohs(udp->dest)];
+                if (p->sent_nsec == 0)
+                    p->state = -1;
+                p->sent_nsec = ts;
+                p->sport = ntohs(udp->source);
+                probes++;
+            }
+        } else if (ip->ip_p == IPPROTO_ICMP) {
+            scan_result_t r;
+            uint32_t src, dst;
+            uint16_t sport, dport;
+            int state = classify_icmp((const unsigned char *)ip, len, &r);
+
+            /* Like a reply, the error must quote the latest probe's source port */
+            if (state < 0 ||
+                icmp_quoted_udp((const unsigned char *)ip, len, &src, &dst, &sport, &dport) < 0 ||
+                src != local || (ports = replay_ports(&targets, dst, 0)) == NULL ||
+                ports[dport].sent_nsec == 0 || ports[dport].sport != sport)
+                continue;
+            if (replay_answer(&ports[dport], state, ts)) {
+                ports[dport].icmp_type = r.icmp_type;
+                ports[dport].icmp_code = r.icmp_code;
+                answers++;
+            }
+        }
+    }
+    elapsed = elapsed_usec(&started) / 1000000.0;
+
+    counter_add(&thread_counters->probes_sent, probes);
+    counter_add(&thread_counters->responses, answers);
+    printf("Replayed %llu packets (%llu probes, %llu answers) from %s in %.3f s",
+           (unsigned long long)packets, (unsigned long long)probes,
+           (unsigned long long)answers, path, elapsed);
+    if (elapsed > 0)
+        printf(" (%.2f Mpps)", packets / elapsed / 1e6);
+    printf("\n\n");
+    fflush(stdout);
+
+    for (replay_target_t *t = targets, *next; t != NULL; t = next) {
+        for (int port = 1; port < 65536; port++) {
+            const replay_port_t *p = &t->ports[port];
+            udp_probe_t *probe = get_probe_for_port(port);
+            scan_result_t result;
+
+            if (p->sent_nsec == 0)
+                continue;
+
+            memset(&result, 0, sizeof(result));
+            result.target = t->addr;
+            result.port = port;
+            result.state = p->state >= 0 ? (port_state_t)p->state : PORT_OPEN_FILTERED;
+            result.service_name = probe ? probe->service_name : NULL;
+            result.probe_name = probe ? probe->probe_name : "empty";
+            result.probe_id = probe ? probe - udp_probes : PROBE_ID_GENERIC;
+            result.rtt_usec = p->state >= 0 ? p->rtt_usec : -1;
+            result.rtt_source = RTT_SOURCE_KERNEL;
+            result.bytes = p->bytes;
+            result.icmp_type = p->state >= 0 && p->state != PORT_OPEN ? p->icmp_type : -1;
+            result.icmp_code = p->state >= 0 && p->state != PORT_OPEN ? p->icmp_code : -1;
+            if (p->state == PORT_OPEN)
+                result.banner = banner_copy(&thread_arena, map + p->payload_off,
+                                            p->payload_len);
+
+            if (p->state >= 0) {
+                host_rtt_update(result.rtt_usec, result.rtt_source);
+                latency_record(thread_counters, result.probe_id,
+                               result.state == PORT_OPEN ? LAT_UDP_REPLY : LAT_ICMP_ERROR,
+                               result.rtt_usec);
+            }
+            counter_add(&thread_counters->results[result.state], 1);
+            counter_add(&thread_counters->ports_done, 1);
+            stats.total_ports++;
+            report_result(&result);
+            arena_release(&thread_arena);
+        }
+        next = t->next;
+        free(t->ports);
+        free(t);
+    }
+    munmap((void *)map, st.st_size);
+    return 0;
+}
+
+/* Print usage */
+void print_usage(const char *prog_name) {
+    printf("UDP Port Scanner with Protocol-Specific Probes\n");
+    printf("Usage: %s [options] <target_ip> <start_port> <end_port>\n", prog_name);
+    printf("       %s [options] --replay <file.pcap>\n", prog_name);
+    printf("\nOptions:\n");
+    printf("  -j, --json <file>     Write results as JSON Lines to <file>\n");
+    printf("  -c, --csv <file>      Write results as CSV to <file>\n");
+    printf("  -x, --xml <file>      Write results as XML to <file>\n");
+    printf("  -b, --binary <file>   Append fixed-size binary records to <file>\n");
+    printf("  -H, --history <dir>   Store results in an append-only scan history\n");
+    printf("  -S, --stream <path>   Push results to a Unix socket or FIFO consumer\n");
+    printf("      --stream-format <fmt>  json (default) or binary\n");
+    printf("      --stream-policy <p>    When the consumer lags: drop (default),\n");
+    printf("                             block or spill (to a file in $TMPDIR)\n");
+    printf("      --stream-queue <n>     Records queued in memory (%d)\n", STREAM_QUEUE_RECORDS);
+    printf("  -s, --states <list>   Only report these states (open,closed,filtered,\n");
+    printf("                        open-filtered)\n");
+    printf("  -o, --open            Only report open ports (same as --states open)\n");
+    printf("  -r, --ranges          Collapse runs of non-open ports into ranges\n");
+    printf("  -B, --baseline <path> Incremental re-scan against a binary log or\n");
+    printf("                        history store: skip recently closed ports,\n");
+    printf("                        re-check open ones with one fast probe\n");
+    printf("  -A, --max-age <hours> Trust baseline CLOSED results this long (%d)\n",
+           BASELINE_MAX_AGE_HOURS);
+    printf("  -p, --progress[=sec]  Print progress to stderr every sec seconds (%d)\n",
+           PROGRESS_INTERVAL_SEC);
+    printf("  -M, --metrics <port>  Serve Prometheus metrics on 127.0.0.1:<port>\n");
+    printf("  -P, --pcap <file>     Capture sent probes and received UDP/ICMP packets\n");
+    printf("  -R, --replay <file>   Classify a pcap capture offline instead of scanning\n");
+    printf("      --flight <file>   Flight recorder dump written on SIGUSR1 or a crash\n");
+    printf("                        (udp_scanner-<pid>.flight)\n");
+    printf("      --state <file>    Keep port states in <file> and resume from it,\n");
+    printf("                        skipping ports it already has\n");
+    printf("  -h, --help            Show this help\n");
+    printf("\nExamples:\n");
+    printf("  %s 192.168.1.1 1 1000          # Scan ports 1-1000\n", prog_name);
+    printf("  %s 10.0.0.1 53 53              # Scan DNS port\n", prog_name);
+    printf("  %s 192.168.1.1 1 65535         # Full port scan\n", prog_name);
+    printf("  %s -j scan.jsonl 10.0.0.1 1 1024  # Structured output\n", prog_name);
+    printf("\nNote: Requires root/sudo for ICMP detection\n");
+}
+
+/*
+ * Where probes and responses may have been lost on this host: system calls
+ * per probe, failed sends by errno, datagrams dropped by our own sockets'
+ * full receive queues, and the kernel's UDP buffer errors over the scan
+ * (namespace-wide, so other traffic counts too).
+ */
+void syscall_report(const progress_sample_t *sample) {
+    double probes = sample->probes_sent > 0 ? sample->probes_sent : 1;
+    udp_snmp_t snmp;
+
+    printf("\n=== Host Accounting ===\n");
+    printf("Syscalls per probe:");
+    for (int i = 0; i < SYSCALL_KINDS; i++)
+        printf(" %s %.2f%s", syscall_names[i], sample->syscalls[i] / probes,
+               i + 1 < SYSCALL_KINDS ? "," : "\n");
+    printf("Send errors:");
+    for (int i = 0; i < SEND_ERRNO_KINDS; i++)
+        printf(" %s %llu%s", send_errno_names[i], (unsigned long long)sample->send_errno[i],
+               i + 1 < SEND_ERRNO_KINDS ? "," : "\n");
+    printf("Receive queue overflows (SO_RXQ_OVFL): %llu\n",
+           (unsigned long long)sample->rxq_drops);
+    printf("Truncated receives (over %d bytes): %llu\n", RX_BUF_SIZE,
+           (unsigned long long)sample->rx_truncated);
+    if (snmp_at_start_valid && read_udp_snmp(&snmp) == 0) {
+        printf("Kernel UDP drops (/proc/net/snmp): RcvbufErrors +%llu, SndbufErrors +%llu\n",
+               (unsigned long long)(snmp.rcvbuf_errors - snmp_at_start.rcvbuf_errors),
+               (unsigned long long)(snmp.sndbuf_errors - snmp_at_start.sndbuf_errors));
+    }
+}
+
+/* Print statistics */
+void print_statistics() {
+    progress_sample_t sent;
+    double elapsed;
+    
+    gettimeofday(&stats.end_time, NULL);
+    elapsed = (stats.end_time.tv_sec - stats.start_time.tv_sec) +
+              (stats.end_time.tv_usec - stats.start_time.tv_usec) / 1000000.0;
+
+    counters_sample(&sent);
+
+    printf("\n=== Scan Statistics ===\n");
+    printf("Total ports scanned: %d\n", stats.total_ports);
+    printf("Open ports: %d\n", stats.open_ports);
+    printf("Closed ports: %d\n", stats.closed_ports);
+    printf("Filtered/Open|Filtered: %d\n", stats.filtered_ports);
+    printf("Probes sent: %llu (%llu send errors)\n",
+           (unsigned long long)sent.probes_sent, (unsigned long long)sent.send_errors);
+    if (baseline != NULL) {
+        printf("Skipped (closed in baseline): %d\n", stats.skipped_ports);
+    }
+    if (config.state_path != NULL) {
+        printf("Skipped (already in %s): %d\n", config.state_path, stats.resumed_ports);
+    }
+    if (host_rtt.samples > 0) {
+        printf("RTT: srtt %.2f ms, rttvar %.2f ms, probe timeout %.1f ms "
+               "(%ld samples, %ld kernel-timestamped)\n",
+               host_rtt.srtt_usec / 1000.0, host_rtt.rttvar_usec / 1000.0,
+               host_timeout_usec() / 1000.0, host_rtt.samples, host_rtt.kernel_samples);
+    }
+    printf("Scan duration: %.2f seconds\n", elapsed);
+    printf("Scan rate: %.2f ports/sec\n", stats.total_ports / elapsed);
+
+    engine_tables_report();
+
+    syscall_report(&sent);
+    latency_report();
+}
+
+/* bench/microbench.c includes this file and supplies its own main */
+#ifndef UDP_SCANNER_NO_MAIN
+int main(int argc, char *argv[]) {
+    char *target_ip;
+    int start_port, end_port;
+    int port;
+    int opt;
+    scan_counters_t *counters;
+    int timestamp_anchor;
+    const char *live_only = NULL;   /* Last option that needs a live scan */
+
+    static const struct option long_options[] = {
+        {"json",    required_argument, NULL, 'j'},
+        {"binary",  required_argument, NULL, 'b'},
+        {"csv",     required_argument, NULL, 'c'},
+        {"xml",     required_argument, NULL, 'x'},
+        {"history", required_argument, NULL, 'H'},
+        {"stream",  required_argument, NULL, 'S'},
+        {"stream-format", required_argument, NULL, OPT_STREAM_FORMAT},
+        {"stream-policy", required_argument, NULL, OPT_STREAM_POLICY},
+        {"stream-queue", required_argument, NULL, OPT_STREAM_QUEUE},
+        {"states",  required_argument, NULL, 's'},
+        {"open",    no_argument,       NULL, 'o'},
+        {"ranges",  no_argument,       NULL, 'r'},
+        {"baseline", required_argument, NULL, 'B'},
+        {"max-age", required_argument, NULL, 'A'},
+        {"progress", optional_argument, NULL, 'p'},
+        {"metrics", required_argument, NULL, 'M'},
+        {"pcap",    required_argument, NULL, 'P'},
+        {"replay",  required_argument, NULL, 'R'},
+        {"flight",  required_argument, NULL, OPT_FLIGHT},
+        {"state",   required_argument, NULL, OPT_STATE},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL,      0,                 NULL, 0}
+    };
+
+    /* Human-readable results always go to standard output */
+    output_add_sink("text", NULL);
+
+    while ((opt = getopt_long(argc, argv, "j:b:c:x:H:S:s:orB:A:p::M:P:R:h", long_options, NULL)) != -1) {
+        int ret = 0;
+
+        switch (opt) {
+        case 'j':
+            ret = output_add_sink("json", optarg);
+            break;
+        case 'b':
+            ret = output_add_sink("binary", optarg);
+            break;
+        case 'c':
+            ret = output_add_sink("csv", optarg);
+            break;
+        case 'x':
+            ret = output_add_sink("xml", optarg);
+            break;
+        case 'H':
+            ret = output_add_sink("history", optarg);
+            live_only = "history";
+            break;
+        case 'S':
+            config.stream_path = optarg;
+            break;
+        case OPT_STREAM_FORMAT:
+            if (strcmp(optarg, "json") != 0 && strcmp(optarg, "binary") != 0) {
+                fprintf(stderr, "Error: Unknown stream format '%s'\n", optarg);
+                return 1;
+            }
+            config.stream_format = optarg;
+            break;
+        case OPT_STREAM_POLICY:
+            if (strcmp(optarg, "block") == 0) {
+                config.stream_policy = OVERFLOW_BLOCK;
+            } else if (strcmp(optarg, "drop") == 0) {
+                config.stream_policy = OVERFLOW_DROP;
+            } else if (strcmp(optarg, "spill") == 0) {
+                config.stream_policy = OVERFLOW_SPILL;
+            } else {
+                fprintf(stderr, "Error: Unknown stream policy '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_STREAM_QUEUE:
+            config.stream_queue = atoi(optarg);
+            if (config.stream_queue <= 0) {
+                fprintf(stderr, "Error: Invalid stream queue length '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            config.state_mask = parse_state_list(optarg);
+            if (config.state_mask == 0) {
+                fprintf(stderr, "Error: Invalid state list '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            config.state_mask = 1u << PORT_OPEN;
+            break;
+        case 'r':
+            config.ranges = 1;
+            break;
+        case 'B':
+            config.baseline_path = optarg;
+            live_only = "baseline";
+            break;
+        case 'A': {
+            char *end;
+            long hours = strtol(optarg, &end, 10);
+
+            if (end == optarg || *end != '\0' || hours < 0 || hours > LONG_MAX / 3600) {
+                fprintf(stderr, "Error: Invalid baseline max age '%s'\n", optarg);
+                return 1;
+            }
+            config.baseline_max_age = hours * 3600L;
+            break;
+        }
+        case 'p':
+            progress.interval = optarg ? atoi(optarg) : PROGRESS_INTERVAL_SEC;
+            if (progress.interval <= 0) {
+                fprintf(stderr, "Error: Invalid progress interval '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'M':
+            metrics.port = atoi(optarg);
+            if (metrics.port <= 0 || metrics.port > 65535) {
+                fprintf(stderr, "Error: Invalid metrics port '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'P':
+            config.pcap_path = optarg;
+            live_only = "pcap";
+            break;
+        case 'R':
+            config.replay_path = optarg;
+            break;
+        case OPT_FLIGHT:
+            config.flight_path = optarg;
+            live_only = "flight";
+            break;
+        case OPT_STATE:
+            config.state_path = optarg;
+            live_only = "state";
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        if (ret < 0) {
+            fprintf(stderr, "Error: At most %d outputs are supported\n", MAX_SINKS);
+            return 1;
+        }
+    }
+
+    if (argc - optind != (config.replay_path ? 0 : 3)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    /* A replay has no single target or port range for these to describe */
+    if (config.replay_path && live_only) {
+        fprintf(stderr, "Error: --%s cannot be used with --replay\n", live_only);
+        return 1;
+    }
+
+    if (config.stream_path &&
+        output_add_stream(config.stream_path, config.stream_format,
+                          config.stream_policy, config.stream_queue) < 0) {
+        fprintf(stderr, "Error: At most %d outputs are supported\n", MAX_SINKS);
+        return 1;
+    }
+
+    /* A consumer that goes away must show up as a write error, not kill the scan */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (config.replay_path) {
+        if (output_open() < 0)
+            return 1;
+        gettimeofday(&stats.start_time, NULL);
+        counters_register();
+        if (replay_pcap(config.replay_path) < 0)
+            return 1;
+        output_close();
+        print_statistics();
+        return 0;
+    }
+
+    target_ip = argv[optind];
+    start_port = atoi(argv[optind + 1]);
+    end_port = atoi(argv[optind + 2]);
+
+    if (start_port < 1 || start_port > 65535 || 
+        end_port < 1 || end_port > 65535 ||
+        start_port > end_port) {
+        fprintf(stderr, "Error: Invalid port range (1-65535)\n");
+        return 1;
+    }
+
+    if (inet_aton(target_ip, &config.target) == 0) {
+        fprintf(stderr, "Error: Invalid target address '%s'\n", target_ip);
+        return 1;
+    }
+    config.start_port = start_port;
+    config.end_port = end_port;
+
+    /* Check if running as root */
+    if (geteuid() != 0) {
+        fprintf(stderr, "Warning: Not running as root. ICMP detection will fail.\n");
+        fprintf(stderr, "Run with sudo for accurate results.\n\n");
+    }
+
+    /*
+     * The kernel stops stamping received packets while no socket asks for
+     * it and turns stamping back on from a work queue. Per-port sockets come
+     * and go, so one idle socket opened ahead of the first probe keeps RX
+     * stamps on for the whole scan.
+     */
+    timestamp_anchor = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (timestamp_anchor >= 0)
+        enable_timestamping(timestamp_anchor, 0);
+
+    printf("Starting UDP scan on %s\n", target_ip);
+    printf("Scanning ports %d-%d\n", start_port, end_port);
+    printf("Using protocol-specific probes for service detection\n");
+    if (config.baseline_path && baseline_load(config.baseline_path) < 0) {
+        return 1;
+    }
+    if (config.state_path && port_store_open(&store, config.state_path, config.target, 1) < 0) {
+        return 1;
+    }
+    printf("\n");
+    fflush(stdout);
+
+    /* Open every output before probing starts */
+    if (output_open() < 0 || capture_open(config.pcap_path, config.target) < 0) {
+        return 1;
+    }
+    flight_start(config.flight_path);
+
+    gettimeofday(&stats.start_time, NULL);
+    snmp_at_start_valid = read_udp_snmp(&snmp_at_start) == 0;
+    counters = counters_register();
+    progress_start(end_port - start_port + 1);
+    if (metrics_start(end_port - start_port + 1) < 0) {
+        return 1;
+    }
+
+    /* Scan ports */
+    for (port = start_port; port <= end_port; port++) {
+        scan_result_t resumed;
+        long unused;
+
+        if (port_store_result(&store, config.target, port, &resumed) == 0) {
+            stats.resumed_ports++;
+            counter_add(&counters->ports_done, 1);
+            report_result(&resumed);
+            continue;
+        }
+        if (baseline_plan(port, &unused) == PLAN_SKIP) {
+            stats.skipped_ports++;
+            counter_add(&counters->ports_done, 1);
+            continue;
+        }
+
+        scan_udp_port(target_ip, port);
+        stats.total_ports++;
+        counter_add(&counters->ports_done, 1);
+        
+        /* Rate limiting to avoid overwhelming target */
+        usleep(PROBE_INTERVAL_USEC);
+    }
+
+    progress_stop();
+    metrics_stop();
+    capture_close();
+    output_close();
+    port_store_close(&store);
+    if (timestamp_anchor >= 0)
+        close(timestamp_anchor);
 
     print_statistics();
 
     return 0;
 }
+#endif /* UDP_SCANNER_NO_MAIN */